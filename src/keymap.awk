@@ -0,0 +1,87 @@
+# Generates keymap.h from keymap.txt, run on the build host:
+# awk -f keymap.awk keymap.txt > keymap.h
+# The key ids must match the folding done by the decoder in ps2decode.c
+
+function hex(str,    i, c, val) {
+	val = 0
+	str = toupper(str)
+	for (i = 1; i <= length(str); i++) {
+		c = index("0123456789ABCDEF", substr(str, i, 1))
+		if (c == 0) {
+			printf("%s:%d: invalid hex value %s\n", FILENAME, FNR, str) > "/dev/stderr"
+			failed = 1
+			exit 1
+		}
+		val = val * 16 + c - 1
+	}
+	return val
+}
+
+function put(table, code, usage) {
+	if ((code, table) in map) {
+		printf("%s:%d: duplicated scancode %s %02X\n", FILENAME, FNR, table, code) > "/dev/stderr"
+		failed = 1
+		exit 1
+	}
+	map[code, table] = usage
+}
+
+/^[ \t]*(#|$)/ { next }
+
+{
+	code = hex($2)
+	usage = hex($3)
+	if ($1 == "-") {
+		if (code == 131) {        # 0x83 F7
+			code = 2
+		} else if (code == 132) { # 0x84 Alt + print screen
+			code = 127
+		} else if (code > 127) {
+			printf("%s:%d: scancode %s out of range\n", FILENAME, FNR, $2) > "/dev/stderr"
+			failed = 1
+			exit 1
+		}
+		put("base", code, usage)
+	} else if ($1 == "E0") {
+		if (code > 127) {
+			printf("%s:%d: scancode %s out of range\n", FILENAME, FNR, $2) > "/dev/stderr"
+			failed = 1
+			exit 1
+		}
+		put("E0", code, usage)
+	} else if ($1 == "E1") {
+		put("E0", 0, usage)   # the decoder reports pause as E0 00
+	} else {
+		printf("%s:%d: unknown prefix %s\n", FILENAME, FNR, $1) > "/dev/stderr"
+		failed = 1
+		exit 1
+	}
+}
+
+function table(name, id,    i) {
+	printf("static const uint8_t %s[128] PROGMEM = {", name)
+	for (i = 0; i < 128; i++) {
+		if ((i % 16) == 0) {
+			printf("\n\t")
+		}
+		if ((i, id) in map) {
+			printf("0x%02X,", map[i, id])
+		} else {
+			printf("0xFF,")
+		}
+		if ((i % 16) != 15) {
+			printf(" ")
+		}
+	}
+	printf("\n};\n\n")
+}
+
+END {
+	if (failed) {
+		exit 1
+	}
+	printf("/* Generated by keymap.awk from keymap.txt - do not edit */\n\n")
+	printf("//USB usage id for each key id, 0xFF = unsupported\n")
+	table("g_keymapBase", "base")
+	table("g_keymapE0", "E0")
+}
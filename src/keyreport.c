@@ -0,0 +1,186 @@
+/*
+USB HID report builder, converts the pressed PS/2 keys into the keyboard,
+consumer control and system control reports. Does not access any hardware,
+so it can be compiled for other targets too.
+
+Copyright (C) 2020-2021 Malte Marwedel
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "keyreport.h"
+#include "ps2kbd.h"
+#include "keymap.h"
+
+//keymap usages from here on are sent by the consumer or system control report, see g_extraUsages
+#define USAGE_EXTRA_FIRST 0xE8
+#define EXTRA_SYSTEM 0x8000
+
+//consumer (page 0x0C) or system control (page 0x01) usages of the keymap usages 0xE8...
+static const uint16_t g_extraUsages[] PROGMEM = {
+	0xE2, //0xE8 mute
+	0xE9, //0xE9 volume up
+	0xEA, //0xEA volume down
+	0xCD, //0xEB play/pause
+	0xB7, //0xEC stop
+	0xB5, //0xED next track
+	0xB6, //0xEE previous track
+	EXTRA_SYSTEM | 0x81, //0xEF power down
+	EXTRA_SYSTEM | 0x82, //0xF0 sleep
+	EXTRA_SYSTEM | 0x83, //0xF1 wake up
+};
+
+//one LPM, about 20 cycles with the call. The former 32 bit switch needed 40..70, counted by hand
+uint8_t convertTable(uint8_t ps2key, uint8_t modifiers)
+{
+	if (ps2key & 0x80) {
+		return pgm_read_byte(&g_keymapE0[ps2key & 0x7F]);
+	}
+	if ((ps2key == PS2_KEY_SYSRQ) && (modifiers & ((1<<KB_L_ALT) | (1<<KB_R_ALT)))) {
+		return 0x46; //print screen when alt or compose is pressed
+	}
+	return pgm_read_byte(&g_keymapBase[ps2key]);
+}
+
+
+bool ignoreStrangePs2(uint8_t data) {
+	/*strange things: We get a release event on a second key press,
+	 and then a press event when we release the key 0xE0F059, ending up with a
+	 not removed entry in our pressed list.
+	*/
+	if (data == PS2_E0(0x12)) { //print screen (part1), also added in some cases when left shift is hold
+		return true;
+	}
+	if (data == PS2_E0(0x59)) { //if a right shift is hold and then a pos end, or cursor is pressed
+		return true;
+	}
+	return false;
+}
+
+bool keyEventApply(uint8_t * keysPressed, uint8_t * modifiers, const ps2event_t * event, bool releases)
+{
+	bool newState = false;
+	uint8_t keycodeNew = event->key;
+	uint8_t modifiersNew = *modifiers;
+	if ((event->type == PS2EVENT_PRESS) && (keysPressed[keycodeNew / 8] & (1 << (keycodeNew & 7)))) {
+		return false; //typematic repeat
+	}
+	if (ignoreStrangePs2(keycodeNew)) {
+		return false;
+	}
+	uint8_t usb = convertTable(keycodeNew, *modifiers);
+	if ((usb >= 0xE0) && (usb <= 0xE7)) {
+		//bit positions of the modifier byte match the usage ids
+		if (event->type == PS2EVENT_PRESS) {
+			modifiersNew |= (1 << (usb - 0xE0));
+		} else {
+			modifiersNew &= ~(1 << (usb - 0xE0));
+		}
+		keycodeNew = 0;
+	}
+	uint8_t keyMask = 1 << (keycodeNew & 7);
+	uint8_t * keyByte = &keysPressed[keycodeNew / 8];
+	if (event->type == PS2EVENT_PRESS) {
+		if (keycodeNew) {
+			printf_P(PSTR("Press 0x%x-0x%x\r\n"), modifiersNew, keycodeNew);
+			*keyByte |= keyMask;
+			newState = true;
+		}
+	} else { //release
+		if (keycodeNew) {
+			if (*keyByte & keyMask) {
+				printf_P(PSTR("Release 0x%x\r\n"), keycodeNew);
+				*keyByte &= ~keyMask;
+				if (releases) {
+					newState = true;
+				}
+			} else {
+				printf_P(PSTR("Release 0x%x not in list!\r\n"), keycodeNew);
+			}
+		}
+	}
+	if (modifiersNew != *modifiers) {
+		*modifiers = modifiersNew;
+		newState = true;
+	}
+	return newState;
+}
+
+void keyReportBuild(const uint8_t * keysPressed, uint8_t * modifiers, uint8_t * usages, uint16_t * consumer, uint8_t * system)
+{
+	memset(usages, 0, USBNKROUSAGES / 8);
+	*consumer = 0; //only one media key at a time
+	*system = 0;
+	for (uint8_t byte = 0; byte < KEYBITMAPBYTES; byte++) {
+		uint8_t bits = keysPressed[byte];
+		for (uint8_t bit = 0; bits; bit++, bits >>= 1) {
+			if (bits & 1) {
+				uint8_t keycode = byte * 8 + bit;
+				uint8_t usb = convertTable(keycode, *modifiers);
+				bool incept = UsbAlternateHook(&usb, modifiers);
+				if ((usb) && (usb < USBNKROUSAGES)) {
+					usages[usb / 8] |= (1 << (usb & 7));
+				} else if ((usb >= USAGE_EXTRA_FIRST) &&
+				           (usb < USAGE_EXTRA_FIRST + sizeof(g_extraUsages) / sizeof(uint16_t))) {
+					uint16_t extra = pgm_read_word(&g_extraUsages[usb - USAGE_EXTRA_FIRST]);
+					if (extra & EXTRA_SYSTEM) {
+						*system |= 1 << ((extra & 0xFF) - 0x81);
+					} else if (*consumer == 0) {
+						*consumer = extra;
+					}
+				} else if ((usb) && (incept == false)) {
+					printf_P(PSTR("Keycode %u(0x%x) unsupported\r\n"), keycode, keycode);
+				}
+			}
+		}
+	}
+}
+
+void keyReportNkro(uint8_t modifiers, const uint8_t * usages, uint8_t * report)
+{
+	report[0] = REPORTID_KEYBOARD;
+	report[1] = modifiers;
+	memcpy(report + 2, usages, USBNKROUSAGES / 8);
+}
+
+uint8_t keyReportBoot(uint8_t modifiers, const uint8_t * usages, uint8_t * boot)
+{
+	uint8_t num = 0;
+	memset(boot, 0, USBBOOTBYTES);
+	boot[0] = modifiers;
+	for (uint8_t i = 0; i < USBNKROUSAGES; i++) {
+		if ((i & 7) == 0) {
+			uint8_t bits = usages[i / 8];
+			if (bits == 0) {
+				i += 7;
+				continue;
+			}
+		}
+		if (usages[i / 8] & (1 << (i & 7))) {
+			if (num == MAXKEYS) {
+				memset(boot + 2, 0x01, MAXKEYS);
+				return USBBOOTBYTES;
+			}
+			boot[2 + num] = i;
+			num++;
+		}
+	}
+	return num + 2;
+}
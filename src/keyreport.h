@@ -0,0 +1,85 @@
+#pragma once
+/*
+USB HID report builder, converts the pressed PS/2 keys into the keyboard,
+consumer control and system control reports.
+
+Copyright (C) 2020-2021 Malte Marwedel
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ps2decode.h"
+
+//keys of the boot protocol report
+#define MAXKEYS 6
+
+//boot protocol report: modifiers, reserved, MAXKEYS usages
+#define USBBOOTBYTES (MAXKEYS + 2)
+
+//report IDs of the report protocol, the boot protocol report has none
+#define REPORTID_KEYBOARD 1
+#define REPORTID_CONSUMER 2
+#define REPORTID_SYSTEM 3
+
+//report protocol keyboard report: ID, modifiers, then one bit for each usage 0x00..0xDF
+#define USBNKROUSAGES 0xE0
+#define USBNKROBYTES (2 + USBNKROUSAGES / 8)
+
+//consumer control report: ID, one 16 bit usage
+#define USBCONSUMERBYTES 3
+
+//system control report: ID, bits for power down, sleep and wake up
+#define USBSYSTEMBYTES 2
+
+//one bit for each PS/2 key id, see ps2decode.h
+#define KEYBITMAPBYTES (256 / 8)
+
+/*The tables are generated from keymap.txt.
+  returns the USB key. 0 -> ignore 0xFF -> unsupported, give warning on serial port
+*/
+uint8_t convertTable(uint8_t ps2key, uint8_t modifiers);
+
+//true for key ids the keyboard sends in a confusing way, they are not used
+bool ignoreStrangePs2(uint8_t data);
+
+/*Updates the pressed keys and the modifiers by a key event. Typematic repeats
+  of a held key are dropped, the host generates its own.
+  releases: false if the release of a key (not a modifier) should not result
+  in a new report, used during a macro playback.
+  Returns true if a new report is needed.
+*/
+bool keyEventApply(uint8_t * keysPressed, uint8_t * modifiers, const ps2event_t * event, bool releases);
+
+/*Converts the pressed keys into the usages of the reports.
+  usages: bitmap of the keyboard usages 0x00..0xDF
+  consumer: the usage of one pressed media key, 0 = none
+  system: bit 0 power down, bit 1 sleep, bit 2 wake up
+  Every pressed key is passed to UsbAlternateHook first.
+*/
+void keyReportBuild(const uint8_t * keysPressed, uint8_t * modifiers, uint8_t * usages, uint16_t * consumer, uint8_t * system);
+
+//report protocol keyboard report with the ID, always USBNKROBYTES long
+void keyReportNkro(uint8_t modifiers, const uint8_t * usages, uint8_t * report);
+
+//returns the number of used bytes, more than MAXKEYS keys result in ErrorRollOver
+uint8_t keyReportBoot(uint8_t modifiers, const uint8_t * usages, uint8_t * boot);
+
+/*Implemented by the application, may change the usage or the modifiers of a
+  pressed key. Returns true if the key was used for something else.
+*/
+bool UsbAlternateHook(uint8_t * usbCode, uint8_t * modifiers);
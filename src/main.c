@@ -7,10 +7,10 @@ Version 1.0.0
 What works:
 -All but one key on my TATEL-K282 S26381-K257-L120 Siemens Nixdorf keyboard
 -Sending the LED state back from the host
+-BIOS support by the boot protocol
 -Macro recorder and playback
 
 What does not:
--The BIOS does not detect the keyboard
 -The power on/off button on the keyboard does not send a scancode
 
 Electrical connection:
@@ -20,16 +20,17 @@ Connecting the PS/2 keyboard is really simple:
 PortB.2: PS2CLOCK
 PortB.1: PS2DATA
 
-Note: The 2KiB RAM are mostly used. Adding a 256byte global array will result
-in a stack overflow.
+Note: The 2KiB RAM are mostly used. The globals (.data/.bss) take about
+1.55KiB, the largest are the debug print buffer (512), the macro record (~530)
+and the EP1 report queue (128). The descriptors and strings are in flash.
+The remaining ~490 bytes are the stack, which needs up to ~250 bytes. Adding a
+256byte global array will leave no safe margin.
 
 This software supports:
-Common HID protocol
-HID boot subclass (except status LEDs)
-The HID protocol uses an report format which simply match the boot subclass
-
-This software misses support:
-Keyboard boot protocol
+Common HID protocol, reporting all pressed keys as bitmap (NKRO)
+HID boot subclass with the keyboard boot protocol (6KRO), including status LEDs
+Media and power keys by consumer and system control reports (report protocol only)
+Remote wakeup of a suspended host by any key
 
 Tested systems (success):
 Linux Kernel 5.5
@@ -64,6 +65,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdio.h>
 #include <avr/wdt.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <stdbool.h>
 
 #include "main.h"
@@ -75,6 +77,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "uart.h"
 #include "usbn2mc/fifo.h"
 #include "ps2kbd.h"
+#include "keyreport.h"
 
 
 void interrupt_ep_send(void);
@@ -83,33 +86,46 @@ void interrupt_ep_send(void);
 
 #define DBGBUFFERSIZE 512
 
-//the buffer needs 2 bytes for each char + 2 bytes \0 termination
-#define USBSTRINGLEN 50
-
 #define STRING_PRODUCT_INDEX 1
 #define STRING_MANUFACTURER_INDEX 2
 
-#define USB_CFG_HID_REPORT_DESCRIPTOR1_LENGTH 61
-#define USB_CFG_HID_REPORT_DESCRIPTOR2_LENGTH 41
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH 105
 
-#define USB_CFG_LENGTH 66
+#define USB_CFG_LENGTH 41
 
-#define MAXKEYS 6
+//largest report, size of the IN endpoint
+#define USBBYTES USBNKROBYTES
 
-#define USBBYTES (MAXKEYS + 2)
-
-//in ms
+//in ms, 1..255, can be given by the Makefile, e.g. CDEFS = -DPOLLINTERVAL=1
+#ifndef POLLINTERVAL
 #define POLLINTERVAL 10
+#endif
+//selectable over the debug serial port, used after the next enumeration
+#define POLLINTERVAL_FAST 1
 
 //enough for ~18 chars
 #define RECORDSTEPS 40
 
 #define INTERFACEDESCRIPTORS 1
 
+//HID class requests
+#define HID_GET_REPORT 0x01
+#define HID_GET_IDLE 0x02
+#define HID_GET_PROTOCOL 0x03
+#define HID_SET_REPORT 0x09
+#define HID_SET_IDLE 0x0A
+#define HID_SET_PROTOCOL 0x0B
+
+//report IDs with their own idle rate, index 0 stands for all reports in SET_IDLE/GET_IDLE
+#define HIDREPORTIDS 4
+
+//idle rate after SET_CONFIGURATION in 4ms units, HID spec recommends 500ms for keyboards
+#define HIDIDLEDEFAULT (500 / 4)
+
 //================ TYPEDEFS ====================
 
 typedef struct {
-	uint8_t usb[USBBYTES];
+	uint8_t usb[USBBOOTBYTES]; //always in the boot protocol format, saves RAM
 	uint8_t messageLen;
 	uint32_t delayMs;
 } repStep_t;
@@ -132,8 +148,10 @@ char toRS232Buf[DBGBUFFERSIZE];
 //manager for the RS232 debug print buffer
 fifo_t toRS232FIFO;
 
-//RS232 input buffer, only one char is stored, no FIFO - currently never read
-char g_lastDebug;
+//RS232 input buffer, only one char is stored, no FIFO
+//'2' or '3' selects the PS/2 code set, 'r' toggles the PS/2 typematic repeats
+//'f' toggles between the normal and the fast USB poll interval
+volatile char g_lastDebug;
 
 //the macro record and playback data
 macro_t g_Macro;
@@ -141,21 +159,102 @@ macro_t g_Macro;
 //toggle bit for USB send endpoint
 int togl3=0;
 
-//information send over to the USB host
-char g_productString[USBSTRINGLEN];
-//information send over to the USB host
-char g_manufacturerString[USBSTRINGLEN];
+/*1: the host selected the boot protocol with SET_PROTOCOL, reports use the
+  6 key format. Reset to the report protocol by every SET_CONFIGURATION.
+*/
+volatile uint8_t g_bootProtocol;
+
+/*Set by SET_IDLE for each report ID, in 4ms units.
+  0 = only send on changes, otherwise an unchanged report is sent again after
+  this time by the Timer1 tick.
+*/
+volatile uint8_t g_idleRate[HIDREPORTIDS];
+volatile uint16_t g_idleMs[HIDREPORTIDS]; //since the last report
+volatile uint8_t g_idleResend; //bit mask of report IDs, set by Timer1, the main loop sends them again
+
+//answer of GET_PROTOCOL, GET_IDLE and GET_REPORT
+uint8_t g_ep0Answer[USBBYTES];
+
+//data stage of SET_REPORT, the LED output report (with report ID in the report protocol)
+uint8_t g_ep0Data[2];
+
+//LED output report as last set by the host, answer of GET_REPORT(output)
+uint8_t g_ledReport;
+
+/* Reports for EP1 in the order they were created. The entry at the read
+   index is within the FIFO until the host ACKed it, signalled by the TX1
+   event, which then loads the next one. So a press and release within one
+   poll interval are both sent. If the queue is full, a pending report is
+   dropped only if a newer one of the same report ID is queued, so the
+   newest state of every report ID still reaches the host.
+   The indices are free running like the PS/2 buffers, only modified within
+   the USB interrupt or with interrupts disabled.
+   Each entry costs 32 bytes of the 2KB RAM. Besides the one in the FIFO,
+   there is a pending entry for each of the three report IDs.
+*/
+#define REPORTQUEUEENTRIES 4
+
+#if ((REPORTQUEUEENTRIES & (REPORTQUEUEENTRIES - 1)) || (REPORTQUEUEENTRIES > 128))
+#error "REPORTQUEUEENTRIES must be a power of two <= 128"
+#endif
+
+#if (REPORTQUEUEENTRIES < HIDREPORTIDS)
+#error "REPORTQUEUEENTRIES needs one entry for the FIFO and one for each report ID"
+#endif
+
+typedef struct {
+	uint8_t reportId; //the boot protocol report has no ID within the data
+	uint8_t len;
+	uint8_t data[USBBYTES];
+} usbReport_t;
+
+usbReport_t g_reportQueue[REPORTQUEUEENTRIES];
+volatile uint8_t g_reportQueueRead;
+volatile uint8_t g_reportQueueWrite;
+
+/* Newest report of each report ID, answer of GET_REPORT(input).
+   In the boot protocol, the keyboard report uses the boot format.
+*/
+uint8_t g_reportKeyboard[USBBYTES];
+uint8_t g_reportConsumer[USBCONSUMERBYTES];
+uint8_t g_reportSystem[USBSYSTEMBYTES];
+uint8_t * const g_reportLast[HIDREPORTIDS] = {NULL, g_reportKeyboard, g_reportConsumer, g_reportSystem};
+const uint8_t g_reportSize[HIDREPORTIDS] = {0, USBBYTES, USBCONSUMERBYTES, USBSYSTEMBYTES};
+uint8_t g_reportLastLen[HIDREPORTIDS];
+
+//keyboard reports not sent, as they were equal to the previous one. Only used by the main loop
+uint16_t g_reportsSuppressed;
+//reports lost, as the queue for EP1 was full. Only used by the main loop
+uint16_t g_reportsReplaced;
+
+/*information send over to the USB host
+  String descriptors, stored as UTF-16. The AVR is little endian, so each
+  uint16_t results in the byte order required by USB.
+*/
+#define USB_STRING_DESCRIPTOR_HEADER(chars) ((2 * (chars) + 2) | (0x03 << 8))
+
+const uint16_t g_productString[] PROGMEM = {
+	USB_STRING_DESCRIPTOR_HEADER(20),
+	'P', 'S', '/', '2', ' ', 'k', 'e', 'y', 'b', 'o', 'a', 'r', 'd', ' ', 't', 'o', ' ', 'U', 'S', 'B'
+};
+
+const uint16_t g_manufacturerString[] PROGMEM = {
+	USB_STRING_DESCRIPTOR_HEADER(12),
+	'm', 'a', 'r', 'w', 'e', 'd', 'e', 'l', 's', '.', 'd', 'e'
+};
 
 //led state sent by host to the keyboard (in an interrupt)
 volatile uint8_t g_LedByHost;
 volatile uint8_t g_UpdateLed;
+//the report format changed, send the current state again
+volatile uint8_t g_UpdateReport;
 
 //looks interesting, but mainly a testcase for catching rare communication errors
 uint8_t g_BlinkMode;
 
 /* Device Descriptor */
 
-unsigned char usbKeyboard[] =
+const unsigned char usbKeyboard[] PROGMEM =
 {
   0x12,       // 18 length of device descriptor
   0x01,       // descriptor type = device descriptor
@@ -175,79 +274,59 @@ unsigned char usbKeyboard[] =
 
 /* Configuration descriptor
 Get with lsusb -vv -d 1781:
+A macro, as it exists twice in flash, differing only by the poll interval.
  */
-unsigned char usbKeyboardConf[USB_CFG_LENGTH] =
-{
-  0x09,        // 9 length of this descriptor
-  0x02,        // descriptor type = configuration descriptor
-  USB_CFG_LENGTH, 0x00,   // total length with interfaces ... (9+(9+9+7+7) + (9+9+7))
-  INTERFACEDESCRIPTORS, // number of interfaces //1. for OS, 2. for BIOS
-  0x01,        // number if this config. ( arg for setconfig)
-  0x00,        // string index for config
-  0x80,        // attrib for this configuration ( bus powerded, | 0x20 for remote wakup support)
-  100,         // power for this configuration in 2*mA (e.g. 200mA)
-
-
-  //InterfaceDescriptor 2 for BIOS
-  0x09,        // 9 length of this descriptor
-  0x04,        // descriptor type = interface descriptor
-  0x00,        // interface number
-  0x01,        // alternate setting for this interface
-  0x01,        // number endpoints without 0
-  0x03,        // class code -> HID
-  0x01,        // sub-class code 1-> boot interface subclass
-  0x01,        // protocoll code 1-> keyboard, 2-> mouse
-  0x00,        // string index for interface
-  //  HID keyboard descriptor
-  0x9,         // length of this descritpor
-  0x21,        // Descriptor type
-  0x10, 0x01,  // HID class specification
-  0x0,         // Country code
-  0x1,         // num of hid class descriptors
-  0x22,        // report descriptor type
-  USB_CFG_HID_REPORT_DESCRIPTOR2_LENGTH, 0x0, // length of report descriptor
-  //  Endpoint Descriptor for in packets: keyboard to host
-  7,           // sizeof(usbDescrEndpoint)
-  5,           // descriptor type = endpoint
-  0x81,        // IN endpoint number 1
-  0x03,        // attrib: Interrupt endpoint
-  USBBYTES, 0, // maximum packet size
-  POLLINTERVAL,// in ms
-
-  //InterfaceDescriptor 1 for common OS with endpoint for LEDs
-  0x09,        // 9 length of this descriptor
-  0x04,        // descriptor type = interface descriptor
-  0x00,        // interface number
-  0x00,        // alternate setting for this interface
-  0x02,        // number endpoints without 0
-  0x03,        // class code -> HID
-  0x00,        // sub-class code
-  0x00,        // protocoll code 1-> keyboard, 2-> mouse
-  0x00,        // string index for interface
-  //  HID keyboard descriptor
-  0x9,         // 9 length of this descriptor
-  0x21,        // Descriptor type
-  0x10, 0x01,  // HID class specification
-  0x0,         // Country code
-  0x1,         // num of hid class descriptors
-  0x22,        // report descriptor type
-  USB_CFG_HID_REPORT_DESCRIPTOR1_LENGTH, 0x0,  // length of report descriptor
-  //  Endpoint Descriptor for in packets: keyboard to host
-  7,           // sizeof endpoint descriptor
-  5,           // descriptor type = endpoint
-  0x81,        // IN endpoint number 1
-  0x03,        // attrib: Interrupt endpoint
-  USBBYTES, 0, // maximum packet size
-  POLLINTERVAL,// in ms
-  //   Endpoint Descriptor for out packets: host to keyboard LED status
-  7,           // sizeof endpoint descriptor
-  5,           // descriptor type = endpoint
-  0x02,        // OUT endpoint number 2
-  0x03,        // attrib: Interrupt endpoint
-  1, 0,        // maximum packet size
-  POLLINTERVAL,// in ms
+#define USB_KEYBOARD_CONF(pollInterval) \
+{ \
+  0x09,        /* 9 length of this descriptor */                                                    \
+  0x02,        /* descriptor type = configuration descriptor */                                     \
+  USB_CFG_LENGTH & 0xFF, USB_CFG_LENGTH >> 8, /* total length with interfaces ... (9+(9+9+7+7)) */ \
+  INTERFACEDESCRIPTORS, /* number of interfaces */                                                  \
+  0x01,        /* number if this config. ( arg for setconfig) */                                    \
+  0x00,        /* string index for config */                                                        \
+  0xA0,        /* attrib for this configuration ( bus powerded, remote wakeup support) */           \
+  100,         /* power for this configuration in 2*mA (e.g. 200mA) */                              \
+                                                                                                    \
+  /*InterfaceDescriptor with endpoint for LEDs.                                                     \
+    The BIOS selects the boot protocol by SET_PROTOCOL, then the 8 byte                             \
+    boot report is sent instead of the report described by the descriptor.                          \
+  */                                                                                                \
+  0x09,        /* 9 length of this descriptor */                                                    \
+  0x04,        /* descriptor type = interface descriptor */                                         \
+  0x00,        /* interface number */                                                               \
+  0x00,        /* alternate setting for this interface */                                           \
+  0x02,        /* number endpoints without 0 */                                                     \
+  0x03,        /* class code -> HID */                                                              \
+  0x01,        /* sub-class code 1-> boot interface subclass */                                     \
+  0x01,        /* protocoll code 1-> keyboard, 2-> mouse */                                         \
+  0x00,        /* string index for interface */                                                     \
+  /* HID keyboard descriptor */                                                                     \
+  0x9,         /* 9 length of this descriptor */                                                    \
+  0x21,        /* Descriptor type */                                                                \
+  0x10, 0x01,  /* HID class specification */                                                        \
+  0x0,         /* Country code */                                                                   \
+  0x1,         /* num of hid class descriptors */                                                   \
+  0x22,        /* report descriptor type */                                                         \
+  USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH & 0xFF, USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH >> 8, /* length of report descriptor */ \
+  /* Endpoint Descriptor for in packets: keyboard to host */                                        \
+  7,           /* sizeof endpoint descriptor */                                                     \
+  5,           /* descriptor type = endpoint */                                                     \
+  0x81,        /* IN endpoint number 1 */                                                           \
+  0x03,        /* attrib: Interrupt endpoint */                                                     \
+  USBBYTES, 0, /* maximum packet size */                                                            \
+  pollInterval, /* in ms */                                                                         \
+  /* Endpoint Descriptor for out packets: host to keyboard LED status */                            \
+  7,           /* sizeof endpoint descriptor */                                                     \
+  5,           /* descriptor type = endpoint */                                                     \
+  0x02,        /* OUT endpoint number 2 */                                                          \
+  0x03,        /* attrib: Interrupt endpoint */                                                     \
+  2, 0,        /* maximum packet size */                                                            \
+  pollInterval, /* in ms */                                                                         \
+}
 
-};
+const unsigned char usbKeyboardConf[USB_CFG_LENGTH] PROGMEM = USB_KEYBOARD_CONF(POLLINTERVAL);
+//selectable over the debug serial port
+const unsigned char usbKeyboardConfFast[USB_CFG_LENGTH] PROGMEM = USB_KEYBOARD_CONF(POLLINTERVAL_FAST);
 
 
 /* This struct is based on:
@@ -260,10 +339,11 @@ unsigned char usbKeyboardConf[USB_CFG_LENGTH] =
  * LED code from:
  * https://embeddedguruji.blogspot.com/2019/04/learning-usb-hid-in-linux-part-7.html
  */
-uint8_t usbHidReportDescriptor1[USB_CFG_HID_REPORT_DESCRIPTOR1_LENGTH] = { /* USB report descriptor */
+const uint8_t usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] PROGMEM = { /* USB report descriptor */
     0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
     0x09, 0x06,                    // USAGE (Keyboard)
     0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORTID_KEYBOARD,       //   REPORT_ID (1)
     0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
 //The first byte - the 8 control keys
     0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
@@ -273,17 +353,11 @@ uint8_t usbHidReportDescriptor1[USB_CFG_HID_REPORT_DESCRIPTOR1_LENGTH] = { /* US
     0x75, 0x01,                    //   REPORT_SIZE (1)
     0x95, 0x08,                    //   REPORT_COUNT (8)
     0x81, 0x02,                    //   INPUT (Data,Var,Abs)
-//the second byte - reserved by OEM
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x95, 0x01,                    //   REPORT_COUNT (1)
-    0x81, 0x03,                    //   INPUT (Const,Var,Abs)
-//bytes 2-6 - all the other keys
-    0x95, MAXKEYS,                 //   REPORT_COUNT (1) --> increase to 8 to get more than one keypress at the same time
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x25, 0xE7,                    //   LOGICAL_MAXIMUM (231)
+//bytes 2-29 - one bit for each other key, no limit of pressed keys
     0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
-    0x29, 0xE7,                    //   USAGE_MAXIMUM (Keyboard Application)
-    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0x29, USBNKROUSAGES - 1,       //   USAGE_MAXIMUM (0xDF)
+    0x95, USBNKROUSAGES,           //   REPORT_COUNT (224)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
 //the leds as one byte input
     0x05, 0x08,                    //   USAGE_PAGE (LEDs)
     0x19, 0x1,                     //   USAGE_MINIMUM (1)
@@ -296,33 +370,34 @@ uint8_t usbHidReportDescriptor1[USB_CFG_HID_REPORT_DESCRIPTOR1_LENGTH] = { /* US
 //5 padding bits for LED
     0x95, 0x05,                    //   REPORT_COUNT (5)
     0x91, 0x01,                    //   OUTPUT (Const, Var, Abs)
-    0xc0                           // END_COLLECTION
-};
-
-uint8_t usbHidReportDescriptor2[USB_CFG_HID_REPORT_DESCRIPTOR2_LENGTH] = { /* USB report descriptor */
+    0xc0,                          // END_COLLECTION
+//media keys, one key at a time
+    0x05, 0x0c,                    // USAGE_PAGE (Consumer Devices)
+    0x09, 0x01,                    // USAGE (Consumer Control)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORTID_CONSUMER,       //   REPORT_ID (2)
+    0x19, 0x00,                    //   USAGE_MINIMUM (Unassigned)
+    0x2a, 0xff, 0x03,              //   USAGE_MAXIMUM (0x3FF)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xff, 0x03,              //   LOGICAL_MAXIMUM (0x3FF)
+    0x75, 0x10,                    //   REPORT_SIZE (16)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0xc0,                          // END_COLLECTION
+//power keys
     0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
-    0x09, 0x06,                    // USAGE (Keyboard)
+    0x09, 0x80,                    // USAGE (System Control)
     0xa1, 0x01,                    // COLLECTION (Application)
-    0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
-//The first byte - the 8 control keys
-    0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
-    0x29, 0xe7,                    //   USAGE_MAXIMUM (Keyboard Right GUI)
+    0x85, REPORTID_SYSTEM,         //   REPORT_ID (3)
+    0x19, 0x81,                    //   USAGE_MINIMUM (System Power Down)
+    0x29, 0x83,                    //   USAGE_MAXIMUM (System Wake Up)
     0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
     0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
     0x75, 0x01,                    //   REPORT_SIZE (1)
-    0x95, 0x08,                    //   REPORT_COUNT (8)
+    0x95, 0x03,                    //   REPORT_COUNT (3)
     0x81, 0x02,                    //   INPUT (Data,Var,Abs)
-//the second byte - reserved by OEM
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x95, 0x01,                    //   REPORT_COUNT (1)
-    0x81, 0x03,                    //   INPUT (Const,Var,Abs)
-//bytes 2-6 - all the other keys
-    0x95, MAXKEYS,                 //   REPORT_COUNT (1) --> increase to 8 to get more than one keypress at the same time
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x25, 0xE7,                    //   LOGICAL_MAXIMUM (231)
-    0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
-    0x29, 0xE7,                    //   USAGE_MAXIMUM (Keyboard Application)
-    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0x95, 0x05,                    //   REPORT_COUNT (5)
+    0x81, 0x01,                    //   INPUT (Const,Ary,Abs)
     0xc0                           // END_COLLECTION
 };
 
@@ -343,26 +418,229 @@ ISR(USART_RXC_vect)
   g_lastDebug = UDR; //Read to clear
 }
 
-void KeyboardToUsb(uint8_t * data, size_t len)
+//loads the oldest queued report into the FIFO, only call with interrupts disabled
+static void UsbReportWrite(void)
+{
+	usbReport_t * report = &g_reportQueue[g_reportQueueRead & (REPORTQUEUEENTRIES - 1)];
+	USBNWriteFifo(TXD1, report->data, report->len);
+	interrupt_ep_send();
+}
+
+//drops all reports not yet within the FIFO, only call with interrupts disabled
+static void UsbReportQueueFlush(void)
 {
+	uint8_t read = g_reportQueueRead;
+	if (read != g_reportQueueWrite) {
+		g_reportQueueWrite = read + 1;
+	}
+}
+
+/* Removes the newest pending report followed by a newer one of the same
+   report ID, reportId is the one about to be queued. With one entry more
+   than report IDs, there is always such a report in a full queue.
+   Only call with interrupts disabled.
+*/
+static void UsbReportQueueDrop(uint8_t reportId)
+{
+	uint8_t read = g_reportQueueRead;
+	uint8_t write = g_reportQueueWrite;
+	//the entry at the read index is within the FIFO and stays
+	for (uint8_t drop = write - 1; drop != read; drop--) {
+		uint8_t id = g_reportQueue[drop & (REPORTQUEUEENTRIES - 1)].reportId;
+		bool superseded = (id == reportId);
+		for (uint8_t i = drop + 1; i != write; i++) {
+			if (g_reportQueue[i & (REPORTQUEUEENTRIES - 1)].reportId == id) {
+				superseded = true;
+			}
+		}
+		if (superseded) {
+			for (uint8_t i = drop + 1; i != write; i++) {
+				g_reportQueue[(i - 1) & (REPORTQUEUEENTRIES - 1)] = g_reportQueue[i & (REPORTQUEUEENTRIES - 1)];
+			}
+			g_reportQueueWrite = write - 1;
+			g_reportsReplaced++;
+			return;
+		}
+	}
+}
+
+//appends a report to the EP1 queue, only call with interrupts disabled
+static void UsbReportQueue(uint8_t reportId, const uint8_t * data, uint8_t len)
+{
+	g_idleMs[reportId] = 0;
+	if ((uint8_t)(g_reportQueueWrite - g_reportQueueRead) == REPORTQUEUEENTRIES) {
+		UsbReportQueueDrop(reportId);
+	}
+	uint8_t write = g_reportQueueWrite;
+	uint8_t used = write - g_reportQueueRead;
+	usbReport_t * report = &g_reportQueue[write & (REPORTQUEUEENTRIES - 1)];
+	report->reportId = reportId;
+	memcpy(report->data, data, len);
+	report->len = len;
+	g_reportQueueWrite = write + 1;
+	if (used == 0) {
+		UsbReportWrite();
+	}
+}
+
+//returns at once, the report is sent when the host polls for it
+void KeyboardToUsb(uint8_t reportId, const uint8_t * data, uint8_t len)
+{
+	if (len > g_reportSize[reportId]) {
+		len = g_reportSize[reportId];
+	}
+	uint8_t sreg = SREG;
 	cli();
-	//char stat1 = USBNRead(TXS1);                        // get transmitter status
-	USBNWrite(TXC1,FLUSH);
-	int waitcycles = 0;
-	while (USBNRead(TXC1) & FLUSH)                        // get transmitter status
-	{
-		waitcycles++;
+	uint8_t * last = g_reportLast[reportId];
+	if ((g_idleRate[reportId] == 0) && (len == g_reportLastLen[reportId]) && (memcmp(last, data, len) == 0)) {
+		SREG = sreg;
+		g_reportsSuppressed++;
+		return; //the host only wants changes
 	}
-	for (uint16_t i = 0; i < len; i++) {
-		USBNWrite(TXD1,data[i]);
-//		char stat0 = USBNRead(TXS1);                        // get transmitter status
-//		printf("%x\r\n", stat0);
+	memcpy(last, data, len);
+	g_reportLastLen[reportId] = len;
+	UsbReportQueue(reportId, data, len);
+	SREG = sreg;
+}
+
+bool KeyboardToUsbBusy(void)
+{
+	return (g_reportQueueRead != g_reportQueueWrite);
+}
+
+//sends the newest report again, when the idle time has passed
+static void UsbReportResend(uint8_t reportId)
+{
+	uint8_t sreg = SREG;
+	cli();
+	//straight from the newest report, no copy on the stack
+	UsbReportQueue(reportId, g_reportLast[reportId], g_reportLastLen[reportId]);
+	SREG = sreg;
+}
+
+//true if the report differs from the newest one of this report ID
+static bool UsbReportChanged(uint8_t reportId, const uint8_t * data, uint8_t len)
+{
+	bool changed;
+	uint8_t sreg = SREG;
+	cli();
+	changed = (len != g_reportLastLen[reportId]) || (memcmp(g_reportLast[reportId], data, len) != 0);
+	SREG = sreg;
+	return changed;
+}
+
+//the state the host assumes after SET_CONFIGURATION: no key pressed
+static void UsbReportsClear(void)
+{
+	memset(g_reportKeyboard, 0, sizeof(g_reportKeyboard));
+	g_reportKeyboard[0] = REPORTID_KEYBOARD;
+	g_reportLastLen[REPORTID_KEYBOARD] = USBNKROBYTES;
+	memset(g_reportConsumer, 0, sizeof(g_reportConsumer));
+	g_reportConsumer[0] = REPORTID_CONSUMER;
+	g_reportLastLen[REPORTID_CONSUMER] = USBCONSUMERBYTES;
+	memset(g_reportSystem, 0, sizeof(g_reportSystem));
+	g_reportSystem[0] = REPORTID_SYSTEM;
+	g_reportLastLen[REPORTID_SYSTEM] = USBSYSTEMBYTES;
+}
+
+/*Sends the keys in the format of the active protocol.
+  usages: bitmap of the pressed keys 0x00..0xDF
+  Returns false if the report did not change and therefore was not sent.
+*/
+static bool UsbSendKeys(uint8_t modifiers, const uint8_t * usages)
+{
+	uint8_t report[USBBYTES];
+	uint8_t len;
+	if (g_bootProtocol) {
+		keyReportBoot(modifiers, usages, report);
+		len = USBBOOTBYTES; //Linux accepts shorter answers too. Windows not.
+	} else {
+		keyReportNkro(modifiers, usages, report);
+		len = USBNKROBYTES;
 	}
-	interrupt_ep_send();
-	//char stat2 = USBNRead(TXS1);                        // get transmitter status
+	if (!UsbReportChanged(REPORTID_KEYBOARD, report, len)) {
+		//e.g. the release of an unsupported key or a repeated modifier
+		g_reportsSuppressed++;
+		return false;
+	}
+	KeyboardToUsb(REPORTID_KEYBOARD, report, len);
+	return true;
+}
+
+/*Sends the consumer and system control reports if changed, the boot protocol
+  has none. Returns true if a report has been queued.
+*/
+static bool UsbSendExtra(uint16_t consumer, uint8_t system)
+{
+	bool queued = false;
+	if (g_bootProtocol) {
+		return false;
+	}
+	uint8_t reportConsumer[USBCONSUMERBYTES] = {REPORTID_CONSUMER, consumer & 0xFF, consumer >> 8};
+	if (UsbReportChanged(REPORTID_CONSUMER, reportConsumer, USBCONSUMERBYTES)) {
+		printf_P(PSTR("Consumer 0x%x\r\n"), consumer);
+		KeyboardToUsb(REPORTID_CONSUMER, reportConsumer, USBCONSUMERBYTES);
+		queued = true;
+	}
+	uint8_t reportSystem[USBSYSTEMBYTES] = {REPORTID_SYSTEM, system};
+	if (UsbReportChanged(REPORTID_SYSTEM, reportSystem, USBSYSTEMBYTES)) {
+		printf_P(PSTR("System 0x%x\r\n"), system);
+		KeyboardToUsb(REPORTID_SYSTEM, reportSystem, USBSYSTEMBYTES);
+		queued = true;
+	}
+	return queued;
+}
+
+//sends a report given in the boot protocol format, used by the macros
+static void UsbSendBoot(const uint8_t * boot, uint8_t len)
+{
+	uint8_t usages[USBNKROUSAGES / 8] = {0};
+	for (uint8_t i = 2; i < len; i++) {
+		uint8_t usb = boot[i];
+		if (usb < USBNKROUSAGES) {
+			usages[usb / 8] |= (1 << (usb & 7));
+		}
+	}
+	UsbSendKeys(boot[0], usages);
+}
+
+//called within the USB interrupt, after the host fetched the report of EP1
+void tx1FifoCallback(uint8_t txs1) {
+	if (!(txs1 & ACK_STAT)) {
+		//not received by the host, repeat with the same data PID
+		USBNWrite(TXC1, FLUSH);
+		togl3 = 1 - togl3;
+		UsbReportWrite();
+		return;
+	}
+	uint8_t read = g_reportQueueRead;
+	if (read == g_reportQueueWrite) {
+		return; //nothing was loaded
+	}
+	read++;
+	g_reportQueueRead = read;
+	if (read != g_reportQueueWrite) {
+		UsbReportWrite();
+	}
+}
+
+//selects POLLINTERVAL_FAST or POLLINTERVAL, the host uses it after the next enumeration
+void UsbSetPollInterval(bool fast) {
+	cli();
+	USBNInit(usbKeyboard, fast ? usbKeyboardConfFast : usbKeyboardConf);
 	sei();
-	//printf("%x->%x, waited %u\r\n", stat1, stat2, waitcycles);
-	_delay_ms(POLLINTERVAL + 2); //guess: data is ignored when send too fast in a row
+}
+
+//called within the USB interrupt, the FIFO of EP1 has been flushed
+void USBNSetConfigurationHook(void) {
+	togl3 = 0; //the first report after the configuration uses DATA0
+	g_bootProtocol = 0; //HID spec: report protocol is the default
+	memset((uint8_t *)g_idleRate, HIDIDLEDEFAULT, sizeof(g_idleRate));
+	memset((uint16_t *)g_idleMs, 0, sizeof(g_idleMs));
+	g_idleResend = 0;
+	UsbReportsClear();
+	g_reportQueueRead = 0;
+	g_reportQueueWrite = 0;
 }
 
 /* interrupt signal from usb controller */
@@ -377,6 +655,17 @@ volatile uint32_t g_timeMs;
 ISR(TIMER1_COMPA_vect)
 {
 	g_timeMs++;
+	for (uint8_t reportId = REPORTID_KEYBOARD; reportId < HIDREPORTIDS; reportId++) {
+		uint8_t idleRate = g_idleRate[reportId];
+		if (idleRate) {
+			uint16_t idleMs = g_idleMs[reportId] + 1;
+			if (idleMs >= idleRate * 4U) {
+				idleMs = 0;
+				g_idleResend |= (1 << reportId);
+			}
+			g_idleMs[reportId] = idleMs;
+		}
+	}
 }
 
 uint32_t timestampGet(void)
@@ -392,9 +681,100 @@ uint32_t timestampGet(void)
 
 /*************** usb class HID requests  **************/
 
-// reponse for requests on interface
+//stalls the control request, Size = 0 prevents a data stage
+static void UsbStall(EPInfo* ep)
+{
+	ep->Size = 0;
+	USBNWrite(EPC0, USBNRead(EPC0) | STALL);
+}
+
+//answers the data stage of a control read with one byte
+static void UsbAnswerByte(EPInfo* ep, uint8_t value)
+{
+	g_ep0Answer[0] = value;
+	ep->DataPid = 1; //control packets start always with the togl bit set
+	ep->Buf = g_ep0Answer;
+	ep->Flash = 0;
+	ep->Index = 0;
+	ep->Size = 1;
+}
+
+//answers GET_REPORT, a copy is used as the main loop may change the report meanwhile
+static void UsbAnswerReport(EPInfo* ep, const uint8_t * report, uint8_t len)
+{
+	memcpy(g_ep0Answer, report, len);
+	ep->DataPid = 1; //control packets start always with the togl bit set
+	ep->Buf = g_ep0Answer;
+	ep->Flash = 0;
+	ep->Index = 0;
+	ep->Size = len;
+}
+
+//LED output report from EP2 or EP0, called within the USB interrupt
+static void UsbLedsFromHost(uint8_t leds)
+{
+	/* Bit mapping:
+	             USB   PS/2
+		 NumLock    0  -> 1
+		 CapsLock   1  -> 2
+		 ScrollLock 2  -> 0
+	*/
+	uint8_t out = 0;
+	if (leds & 1) out |= 2;
+	if (leds & 2) out |= 4;
+	if (leds & 4) out |= 1;
+	g_ledReport = leds;
+	g_LedByHost = out;
+	g_UpdateLed = 1;
+}
+
+//LED output report, starts with the report ID in the report protocol
+static void UsbLedsReport(const uint8_t * data, uint8_t len)
+{
+	if ((len == 2) && (data[0] == REPORTID_KEYBOARD)) {
+		UsbLedsFromHost(data[1]);
+	} else if (len == 1) {
+		UsbLedsFromHost(data[0]);
+	}
+}
+
+//maps the report ID of a request to the index of the report, 0 if not valid
+static uint8_t UsbReportIndex(uint8_t reportId)
+{
+	if (g_bootProtocol) {
+		return (reportId == 0) ? REPORTID_KEYBOARD : 0;
+	}
+	return (reportId < HIDREPORTIDS) ? reportId : 0;
+}
+
+/*Looks up the endpoint register of an endpoint address (wIndex), EP0 has
+  none (0). Returns false for endpoints this device does not have.
+*/
+static bool UsbEndpointControl(uint16_t address, uint8_t * epc)
+{
+	switch (address) {
+		case 0x00:
+		case 0x80: *epc = 0; return true; //EP0, a stall ends with the next setup packet
+		case 0x81: *epc = EPC1; return true; //keyboard reports
+		case 0x02: *epc = EPC2; return true; //LED reports
+		default: return false;
+	}
+}
+
+//EP1 is no longer halted, called within the USB interrupt
+static void UsbReportRestart(void)
+{
+	USBNWrite(TXC1, FLUSH);
+	togl3 = 0; //the next report uses DATA0
+	if (g_reportQueueRead != g_reportQueueWrite) {
+		UsbReportWrite(); //again with the reset toggle
+	}
+}
+
+// reponse for requests on interface or endpoint
 void USBNInterfaceRequests(DeviceRequest *req,EPInfo* ep)
 {
+	uint8_t epc;
 	printf_P(PSTR("interface request\r\n"));
 	ep->DataPid = 1; //control packets start always with the togl bit set
 	/* Linux requests always exactly the size for the descriptor given in the
@@ -406,42 +786,71 @@ void USBNInterfaceRequests(DeviceRequest *req,EPInfo* ep)
 	if ((req->bmRequestType == 0x81) && (req->bRequest == GET_DESCRIPTOR) &&
 	    (req->wValue == 0x2200) && (req->wIndex < INTERFACEDESCRIPTORS))
 	{
-		//we simply guess by the size...
-		if ((req->wLength == sizeof(usbHidReportDescriptor2)) || (req->wLength == (sizeof(usbHidReportDescriptor2) + 64)))
-		{
-			printf_P(PSTR("Alternate HID descr\r\n"));
-			ep->Buf = usbHidReportDescriptor2;
-			ep->Index = 0;
-			ep->Size = USB_CFG_HID_REPORT_DESCRIPTOR2_LENGTH;
+		printf_P(PSTR("HID descr\r\n"));
+		ep->Buf = (unsigned char *)usbHidReportDescriptor;
+		ep->Flash = 1;
+		ep->Index = 0;
+		ep->Size = USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH;
+	}
+	else if ((req->bmRequestType == 0x1) && (req->bRequest == SET_INTERFACE) &&
+		(req->wIndex < INTERFACEDESCRIPTORS))
+	{
+		//standard request, there is only the alternate setting 0
+		printf_P(PSTR("Set interface %u, alt %u\r\n"), req->wIndex, req->wValue);
+		if (req->wValue == 0) {
+			_USBNTransmitEmtpy(ep);
+		} else {
+			UsbStall(ep);
 		}
-		else if (req->wLength >= sizeof(usbHidReportDescriptor1))
-		{
-			//this is our common default case
-			printf_P(PSTR("Default HID descr\r\n"));
-			ep->Buf = usbHidReportDescriptor1;
-			ep->Index = 0;
-			ep->Size = USB_CFG_HID_REPORT_DESCRIPTOR1_LENGTH;
+	}
+	else if ((req->bmRequestType == 0x81) && (req->bRequest == GET_INTERFACE) &&
+		(req->wIndex < INTERFACEDESCRIPTORS))
+	{
+		UsbAnswerByte(ep, 0);
+	}
+	else if ((req->bmRequestType == 0x81) && (req->bRequest == GET_STATUS) &&
+		(req->wIndex < INTERFACEDESCRIPTORS))
+	{
+		uint8_t status[2] = {0, 0}; //reserved for interfaces
+		UsbAnswerReport(ep, status, 2);
+	}
+	else if ((req->bmRequestType == 0x82) && (req->bRequest == GET_STATUS) &&
+		(UsbEndpointControl(req->wIndex, &epc)))
+	{
+		uint8_t status[2] = {0, 0};
+		if ((epc) && (USBNRead(epc) & STALL)) {
+			status[0] = 1; //halted
 		}
+		UsbAnswerReport(ep, status, 2);
 	}
-	else if ((req->bmRequestType == 0x1) && (req->bRequest == SET_INTERFACE) &&
-		(req->wValue <= 1) && (req->wIndex < INTERFACEDESCRIPTORS))
+	else if ((req->bmRequestType == 0x02) &&
+		((req->bRequest == SET_FEATURE) || (req->bRequest == CLR_FEATURE)) &&
+		(req->wValue == ENDPOINT_HALT) && (UsbEndpointControl(req->wIndex, &epc)))
 	{
-		//The notebook does this as class request, Windows as standard request -> interface request
-		uint8_t reportProtocol = req->wValue;
-		uint8_t setInterface = req->wIndex;
-		printf_P(PSTR("Set interface(1) %u, reportProt %u\r\n"), setInterface, reportProtocol);
-		if (!reportProtocol)
-		{
-			printf_P(PSTR("Error, boot protocol not supported - just ignoring this\r\n"));
+		printf_P(PSTR("Endpoint 0x%x halt %u\r\n"), req->wIndex, req->bRequest == SET_FEATURE);
+		if ((epc) && (req->bRequest == SET_FEATURE)) {
+			USBNWrite(epc, USBNRead(epc) | STALL);
+		} else if (epc) {
+			USBNWrite(epc, USBNRead(epc) & ~STALL);
+			if (epc == EPC1) {
+				UsbReportRestart();
+			}
 		}
 		_USBNTransmitEmtpy(ep);
 	}
 	else
 	{
 		printf_P(PSTR("%x %x %x %x %x\r\n"), req->bmRequestType, req->bRequest, req->wValue, req->wIndex, req->wLength);
+		UsbStall(ep);
 	}
 }
 
+//data stage of SET_REPORT, called within the USB interrupt
+void USBNControlDataHook(unsigned char* buf, int len)
+{
+	UsbLedsReport(buf, len);
+}
+
 /* id need for live update of firmware */
 void USBNDecodeVendorRequest(DeviceRequest *req)
 {
@@ -451,33 +860,64 @@ void USBNDecodeVendorRequest(DeviceRequest *req)
 // class requests
 void USBNDecodeClassRequest(DeviceRequest *req,EPInfo* ep)
 {
-	if ((req->bmRequestType == 0x21) && (req->bRequest == 0xA)) {
-		//Set IDLE request
+	if (req->wIndex >= INTERFACEDESCRIPTORS) {
+		printf_P(PSTR("dec %x %x %x %x %x\r\n"), req->bmRequestType, req->bRequest, req->wValue, req->wIndex, req->wLength);
+		UsbStall(ep);
+	} else if ((req->bmRequestType == 0x21) && (req->bRequest == HID_SET_IDLE)) {
+		//high byte: duration, low byte: report ID, 0 applies to all reports
+		uint8_t duration = req->wValue >> 8;
+		uint8_t reportId = req->wValue & 0xFF;
+		for (uint8_t i = 0; i < HIDREPORTIDS; i++) {
+			if ((reportId == 0) || (reportId == i)) {
+				g_idleRate[i] = duration;
+				g_idleMs[i] = 0;
+			}
+		}
 		/*we should answer with a zero byte package, unfortunately, by default the callback
 		 does not support this
 		*/
 		_USBNTransmitEmtpy(ep);
-		printf_P(PSTR("Set idle req\r\n"));
-	} else if ((req->bmRequestType == 0x21) && (req->bRequest == SET_CONFIGURATION) &&
-	    (req->wValue == 0x200) && (req->wLength == 1)) {
+		printf_P(PSTR("Set idle req %u, ID %u\r\n"), duration, reportId);
+	} else if ((req->bmRequestType == 0xA1) && (req->bRequest == HID_GET_IDLE) &&
+	    ((req->wValue & 0xFF) < HIDREPORTIDS)) {
+		UsbAnswerByte(ep, g_idleRate[req->wValue & 0xFF]);
+	} else if ((req->bmRequestType == 0x21) && (req->bRequest == HID_SET_REPORT) &&
+	    (((req->wValue == 0x200) && (req->wLength == 1)) ||
+	     ((req->wValue == (0x200 | REPORTID_KEYBOARD)) && (req->wLength == 2)))) {
 		/*The host will *not* use this method for notifiying LEDs, if there is a
-		  separate out endpoint. (At least under Linux).
+		  separate out endpoint. (At least under Linux). BIOSes and Windows do.
+		  The LED byte follows in the data stage -> USBNControlDataHook.
 		*/
-		_USBNTransmitEmtpy(ep); //confirm the (failed) LED change...
-		printf_P(PSTR("LEDs changed by EP0, how do we get byte9?\r\n"));
-	} else if ((req->bmRequestType == 0x21) && (req->bRequest == SET_INTERFACE) &&
-	    (req->wValue <= 1) && (req->wIndex < INTERFACEDESCRIPTORS)) {
-		//The notebook does this as class request, Windows as standard request -> interface request
-		uint8_t reportProtocol = req->wValue;
-		uint8_t setInterface = req->wIndex;
-		printf_P(PSTR("Set interface(2) %u, reportProt %u\r\n"), setInterface, reportProtocol);
-		if (!reportProtocol)
-		{
-			printf_P(PSTR("Error, boot protocol not supported - just ignoring this\r\n"));
+		printf_P(PSTR("LEDs changed by EP0\r\n"));
+		_USBNReceiveData(g_ep0Data, req->wLength);
+	} else if ((req->bmRequestType == 0xA1) && (req->bRequest == HID_GET_REPORT) &&
+	    ((req->wValue >> 8) == 1) && (UsbReportIndex(req->wValue & 0xFF))) {
+		uint8_t index = UsbReportIndex(req->wValue & 0xFF);
+		UsbAnswerReport(ep, g_reportLast[index], g_reportLastLen[index]);
+	} else if ((req->bmRequestType == 0xA1) && (req->bRequest == HID_GET_REPORT) &&
+	    ((req->wValue >> 8) == 2) && (UsbReportIndex(req->wValue & 0xFF) == REPORTID_KEYBOARD)) {
+		uint8_t report[2] = {REPORTID_KEYBOARD, g_ledReport};
+		if (g_bootProtocol) {
+			UsbAnswerReport(ep, report + 1, 1);
+		} else {
+			UsbAnswerReport(ep, report, 2);
+		}
+	} else if ((req->bmRequestType == 0x21) && (req->bRequest == HID_SET_PROTOCOL) &&
+	    (req->wValue <= 1)) {
+		//0: boot protocol, 1: report protocol
+		printf_P(PSTR("Set protocol %u\r\n"), req->wValue);
+		uint8_t bootProtocol = !req->wValue;
+		if (bootProtocol != g_bootProtocol) {
+			g_bootProtocol = bootProtocol;
+			UsbReportQueueFlush(); //queued reports have the old format
+			g_UpdateReport = 1; //the report changes its format
 		}
 		_USBNTransmitEmtpy(ep);
+	} else if ((req->bmRequestType == 0xA1) && (req->bRequest == HID_GET_PROTOCOL)) {
+		UsbAnswerByte(ep, !g_bootProtocol);
 	} else {
 		printf_P(PSTR("dec %x %x %x %x %x\r\n"), req->bmRequestType, req->bRequest, req->wValue, req->wIndex, req->wLength);
+		UsbStall(ep);
 	}
 }
 
@@ -514,182 +954,6 @@ static FILE mystdout = FDEV_SETUP_STREAM(uart_put, NULL, _FDEV_SETUP_WRITE);
 
 
 
-/*
-See codes for PS/2, Scancode set 2:
-https://www.avrfreaks.net/sites/default/files/PS2%20Keyboard.pdf
-See codes for USB:
-https://www.usb.org/sites/default/files/documents/hut1_12v2.pdf
-page 53
-
-returns the USB key. 0 -> ignore 0xFF -> unsupported, give warning on serial port
-*/
-uint8_t convertTable(uint32_t ps2code, uint8_t modifiers)
-{
-	switch(ps2code)
-	{
-		case 0x1C: return 0x4; //A
-		case 0x32: return 0x5;
-		case 0x21: return 0x6;
-		case 0x23: return 0x7;
-		case 0x24: return 0x8;
-		case 0x2B: return 0x9;
-		case 0x34: return 0xA;
-		case 0x33: return 0xB;
-		case 0x43: return 0xC;
-		case 0x3B: return 0xD;
-		case 0x42: return 0xE;
-		case 0x4B: return 0xF;
-		case 0x3A: return 0x10;
-		case 0x31: return 0x11;
-		case 0x44: return 0x12;
-		case 0x4D: return 0x13;
-		case 0x15: return 0x14;
-		case 0x2D: return 0x15;
-		case 0x1B: return 0x16;
-		case 0x2C: return 0x17;
-		case 0x3C: return 0x18;
-		case 0x2A: return 0x19;
-		case 0x1D: return 0x1A;
-		case 0x22: return 0x1B;
-		case 0x35: return 0x1C;
-		case 0x1A: return 0x1D; //Z
-		case 0x16: return 0x1E; //1
-		case 0x1E: return 0x1F;
-		case 0x26: return 0x20;
-		case 0x25: return 0x21;
-		case 0x2E: return 0x22;
-		case 0x36: return 0x23;
-		case 0x3D: return 0x24;
-		case 0x3E: return 0x25;
-		case 0x46: return 0x26; //9
-		case 0x45: return 0x27; //0
-		case 0x5A: return 0x28; //enter
-		case 0x76: return 0x29; //escape
-		case 0x66: return 0x2A; //backspace
-		case 0x0D: return 0x2B; //tab
-		case 0x29: return 0x2C; //space
-		case 0x4E: return 0x2D; //-
-		case 0x55: return 0x2E; //=
-		case 0x54: return 0x2F; //[, german ü
-		case 0x5B: return 0x30; //], german +
-		case 0x5D: return 0x31; //backslash, german #
-		//? 0x32 should be non US #, but there is no key on the keyboard...
-		case 0x4C: return 0x33; //;, german ö
-		case 0x52: return 0x34; //', german ä
-		case 0x0E: return 0x35; //`  german ^
-		case 0x41: return 0x36; //,, german ,
-		case 0x49: return 0x37; //., german .
-		case 0x4A: return 0x38; // /, german -
-		case 0x58: return 0x39; //caps lock
-		case 0x05: return 0x3A; //F1
-		case 0x06: return 0x3B; //F2
-		case 0x04: return 0x3C; //F3
-		case 0x0C: return 0x3D; //F4
-		case 0x03: return 0x3E; //F5
-		case 0x0B: return 0x3F; //F6
-		case 0x83: return 0x40; //F7
-		case 0x0A: return 0x41; //F8
-		case 0x01: return 0x42; //F9
-		case 0x09: return 0x43; //F10
-		case 0x78: return 0x44; //F11
-		case 0x07: return 0x45; //F12
-		case 0xE07C: return 0x46;  //print screen (part2) -> use for release, ignore on press
-		case 0x84:
-			if (modifiers & ((1<<KB_L_ALT) | (1<<KB_R_ALT))) {
-				return 0x46; //print screen when alt or compose is pressed
-			} else {
-				return 0x7C; //insert word (S26381-K257-L120 only?)-> copy (cant use, same as Alt+Print)
-			}
-		case 0x7E: return 0x47; //scroll lock
-		case 0xE11477: return 0x48; //pause
-		case 0xE070: return 0x49; //insert, on S26381-K257-L120: "Zeichen einfügen"
-		case 0x48: return 0x49; //SEND (S26381-K257-L120 only?) -> Keyboard insert
-		case 0xE06C: return 0x4A; //home
-		case 0xE07D: return 0x4B; //page up
-		case 0xE071: return 0x4C; //delete
-		case 0xE069: return 0x4D; //end
-		case 0xE07A: return 0x4E; //page down
-		case 0xE074: return 0x4F; //right arrow
-		case 0xE06B: return 0x50; //left arrow
-		case 0xE072: return 0x51; //down arrow
-		case 0xE075: return 0x52; //up arrow
-		case 0x77: return 0x53; //num lock
-		case 0xE04A: return 0x54; //kp /
-		case 0x7C: return 0x55; //kp *
-		case 0x7B: return 0x56; //kp -
-		case 0x79: return 0x57; //kp +
-		case 0xE05A: return 0x58; //kp enter
-		case 0x69: return 0x59; //kp 1
-		case 0x72: return 0x5A; //kp 2
-		case 0x7A: return 0x5B; //kp 3
-		case 0x6B: return 0x5C; //kp 4
-		case 0x73: return 0x5D; //kp 5
-		case 0x74: return 0x5E; //kp 6
-		case 0x6C: return 0x5F; //kp 7
-		case 0x75: return 0x60; //kp 8
-		case 0x7D: return 0x61; //kp 9
-		case 0x70: return 0x62; //kp 0
-		case 0x71: return 0x63; //kp .
-		case 0x61: return 0x64; //german <
-		case 0xE02F: return 0x65; //application - right click context menu
-		//up to here, all keys are required for keyboard usage page for boot
-		//0x66: Keyboard power button
-		case 0x27: return 0x67; //kp =
-		case 0x37: return 0x68; //F13
-		case 0x3F: return 0x69; //F14
-		case 0x5E: return 0x6A; //F15
-		case 0x56: return 0x6B; //F16
-		case 0x2F: return 0x6C; //F17
-		case 0x38: return 0x6D; //F18
-		case 0x53: return 0x6E; //F19
-		case 0x62: return 0x6F; //F20
-		case 0x5F: return 0x70; //F21
-		case 0x40: return 0x71; //F22 (same code as sidata)
-		case 0x28: return 0x72; //end (S26381-K257-L120 only?) -> F23
-		case 0x20: return 0x73; //K3 (S26381-K257-L120 only?)-> F24
-		//0x74 keyboard execute
-		case 0x63: return 0x75; //help (S26381-K257-L120 only?)
-		//0x76 keyboard menu
-		case 0x8: return 0x77; //markier (S26381-K257-L120 only?) -> select
-		//0x78 keyboard stop
-		case 0x10: return 0x79; //druck 2 (S26381-K257-L120 only?)-> again
-		case 0x18: return 0x7A; //druck 1 (S26381-K257-L120 only?) -> undo
-		//0x7B keyboard cut
-		//0x7C keyboard copy - see return of 0x46
-		case 0x51: return 0x7D; //insert line (S26381-K257-L120 only?) -> paste
-		case 0x5C: return 0x7E; //start (S26381-K257-L120 only?) -> find
-		case 0x6F: return 0x7F; //delete char (S26381-K257-L120 only?) -> mute
-		case 0x64: return 0x80; //delete line (S26381-K257-L120 only?) -> vol up
-		case 0x50: return 0x81; //delete word (S26381-K257-L120 only?) -> vol down
-		case 0x19: return 0xD9; //(S26381-K257-L120 only?) kp clear entry
-		//unique rubberdomes at S26381-K257-L120 (TATEL-K282) without any key on it:
-		case 0x17: return 0x9A; //below SIDATA -> move SIDATA cap to this position as SIDATA has the same code as F22 -> return sys request/attention
-		//case 0x60: return 0; //above left arrow
-		//case 0x57: return 0; //above right arrow
-		//case 0x13: return 0; //above context menu key
-		//case 0x49: return 0; //2x above context menu key
-		//case 0x67: return 0: //between druck 2 and Zeichen
-		//case 0xF: return 0: //between markier and druck 1
-
-		default: return 0xFF; //reserved
-	}
-}
-
-
-bool ignoreStrangePs2(uint32_t data) {
-	/*strange things: We get a release event on a second key press,
-	 and then a press event when we release the key 0xE0F059, ending up with a
-	 not removed entry in our pressed list.
-	*/
-	if (data == 0xE012) { //print screen (part1), also added in some cases when left shift is hold
-		return true;
-	}
-	if (data == 0xE059) { //if a right shift is hold and then a pos end, or cursor is pressed
-		return true;
-	}
-	return false;
-}
-
 void macroStop(void)
 {
 	ps2SetLeds(g_LedByHost);
@@ -756,24 +1020,22 @@ bool UsbAlternateHook(uint8_t * usbCode, uint8_t * modifiers) {
 	return incept;
 }
 
-void UpdateUsbKeystate(const uint32_t * keycodes, uint8_t modifiers) {
-	uint8_t usbData[USBBYTES] = {0};
-	uint8_t dataBytes = 2;
-	for (uint8_t i = 0; i < MAXKEYS; i++) {
-		if (keycodes[i]) {
-//			printf_P(PSTR("Converting 0x%x\r\n"), keycodes[i]);
-			uint8_t usb = convertTable(keycodes[i], modifiers);
-			bool incept = UsbAlternateHook(&usb, &modifiers);
-			if ((usb) && (usb != 0xFF)) {
-				usbData[dataBytes] = usb;
-				dataBytes++;
-			} else if ((usb) && (incept == false)) {
-				printf_P(PSTR("Keycode %lu(0x%lx) unsupported\r\n"), (unsigned long)keycodes[i], (unsigned long)keycodes[i]);
-			}
-		}
+/*keysPressed: bitmap of the pressed PS/2 key ids
+  Returns true if a report has been queued for the host.
+*/
+bool UpdateUsbKeystate(const uint8_t * keysPressed, uint8_t modifiers) {
+	uint8_t usages[USBNKROUSAGES / 8];
+	uint16_t consumer;
+	uint8_t system;
+	keyReportBuild(keysPressed, &modifiers, usages, &consumer, &system);
+	//bit positions of the modifiers already proper converted in the main loop
+	bool changed = UsbSendKeys(modifiers, usages);
+	bool extraQueued = UsbSendExtra(consumer, system);
+	if (!changed) {
+		return extraQueued; //nothing new for the keyboard report, e.g. only a media key
 	}
-	usbData[0] = modifiers; //bit positions already proper converted in ps2kbd
-	KeyboardToUsb(usbData, USBBYTES); //Linux accepts shorter answers too (dataBytes). Windows not.
+	uint8_t usbData[USBBOOTBYTES];
+	uint8_t dataBytes = keyReportBoot(modifiers, usages, usbData);
 #if 1
 	printf_P(PSTR("To usb: "));
 	for (int i = 0; i < dataBytes; i++) {
@@ -803,6 +1065,15 @@ void UpdateUsbKeystate(const uint32_t * keycodes, uint8_t modifiers) {
 			}
 		}
 	}
+	return true;
+}
+
+//signals the resume to a suspended host, which enabled the remote wakeup
+static void UsbWakeupHost(void) {
+	//the report waits in the queue until the host polls after the resume
+	if (USBNRemoteWakeup()) {
+		printf_P(PSTR("Remote wakeup\r\n"));
+	}
 }
 
 static bool macroExecute(uint32_t timestamp) {
@@ -838,10 +1109,10 @@ static bool macroExecute(uint32_t timestamp) {
 		}
 	}
 	if (g_Macro.mode == 1) {
-		if (timestamp >= g_Macro.time) {
+		if ((timestamp >= g_Macro.time) && (!KeyboardToUsbBusy())) { //never merge two steps
 			uint8_t index = g_Macro.index;
 			printf_P(PSTR("Macro replay %u\r\n"), index);
-			KeyboardToUsb(g_Macro.record[index].usb, g_Macro.record[index].messageLen);
+			UsbSendBoot(g_Macro.record[index].usb, g_Macro.record[index].messageLen);
 #if 1
 			printf_P(PSTR("To usb %02i: "), index);
 			for (int i = 0; i < g_Macro.record[index].messageLen; i++) {
@@ -856,7 +1127,7 @@ static bool macroExecute(uint32_t timestamp) {
 			} else {
 				uint8_t stopbuffer[2] = {0};
 				if ((g_Macro.record[index].messageLen != 2) || g_Macro.record[index].usb[0] != 0) {
-					KeyboardToUsb(stopbuffer, 2);
+					UsbSendBoot(stopbuffer, 2);
 				}
 				macroStop();
 				printf_P(PSTR("Macro complete\r\n"));
@@ -869,21 +1140,45 @@ static bool macroExecute(uint32_t timestamp) {
 
 void rx1FifoCallback(char * buf, int len) {
 	printf_P(PSTR("Got %u bytes\r\n"), len);
-	if (len)
-	{
-		/* Bit mapping:
-		             USB   PS/2
-			 NumLock    0  -> 1
-			 CapsLock   1  -> 2
-			 ScrollLock 2  -> 0
-		*/
-		uint8_t out = 0;
-		if (buf[0] & 1) out |= 2;
-		if (buf[0] & 2) out |= 4;
-		if (buf[0] & 4) out |= 1;
-		g_LedByHost = out;
-		g_UpdateLed = 1;
+	UsbLedsReport((uint8_t *)buf, len);
+}
+
+/*Power down while the USB is suspended. INT0 (USBN9604 resume or reset) and
+  INT2 (PS/2 clock) wake up. Timer1 stops, so the ms timestamp pauses.
+  The USBN9604 clock output is our CPU clock and runs with 3MHz meanwhile.
+  With the low fuse 10100000 of the README (CKSEL 0000 external clock,
+  SUT 10), the CPU starts within 6 clocks, fast enough for the first bit of
+  the PS/2 frame. The PS/2 keyboard retries of KBDLOST use the timestamp and
+  pause too, so the keyboard is checked again after the resume.
+*/
+static void UsbSuspendSleep(void)
+{
+	//returns at once while a PS/2 frame, command or keyboard reset is pending
+	cli();
+	bool sleep = (USBNSuspended()) && (ps2Idle());
+	sei();
+	if (!sleep) {
+		return;
+	}
+	PORTA &= ~(1 << PA4);
+	while (toRS232FIFO.count > 0); //the baudrate is wrong with the slow clock
+	_delay_ms(2); //the last two characters leave the UART
+	wdt_disable();
+	cli();
+	if ((USBNSuspended()) && (ps2Idle())) { //the keyboard may have started to send meanwhile
+		USBNWrite(CCONF, 0x0F); //48MHz / 16
+		MCUCR &= ~((1 << ISC01) | (1 << ISC00)); //only the low level wakes from power down
+		set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+		sleep_enable();
+		sei();
+		sleep_cpu(); //the interrupts are only handled after this instruction
+		sleep_disable();
+		cli();
+		MCUCR |= (1 << ISC01); //falling edge again
+		USBNWrite(CCONF, 0x02); //16MHz
 	}
+	sei();
+	wdt_enable(WDTO_1S);
 }
 
 int main(void) {
@@ -920,10 +1215,11 @@ int main(void) {
 	USBNInit(usbKeyboard,usbKeyboardConf); //does not initialize anything, just store variable references
 	//the EP1 is enabled by the incoming set configuration packet
 
-	USBNSetString(g_manufacturerString, USBSTRINGLEN, "marwedels.de", STRING_MANUFACTURER_INDEX);
-	USBNSetString(g_productString, USBSTRINGLEN, "PS/2 keyboard to USB", STRING_PRODUCT_INDEX);
+	USBNSetString(g_manufacturerString, STRING_MANUFACTURER_INDEX);
+	USBNSetString(g_productString, STRING_PRODUCT_INDEX);
 
 	USBNCallbackFIFORX1(&rx1FifoCallback);
+	USBNCallbackFIFOTX1(&tx1FifoCallback);
 
 	sei();
 
@@ -931,11 +1227,6 @@ int main(void) {
 
 	USBNStart(); // start device stack, just endpoint 0 is now set up
 
-	for (int i = 0; i < 10; i++) { //The PS/2 keyboard might take 500..750ms
-		_delay_ms(100);
-		wdt_reset();
-	}
-
 	printf_P(PSTR("Init PS/2...\r\n"));
 
 	ps2ReadInit();
@@ -956,73 +1247,53 @@ int main(void) {
 	uint32_t blinkTimeout = 0;
 	uint8_t blinkToggle = 0;
 
-	uint32_t keycodePressed[MAXKEYS] = {0};
-	uint8_t modifierOld = 0;
+	uint8_t keysPressed[KEYBITMAPBYTES] = {0}; //bitmap of the PS/2 key ids
+	uint8_t modifiers = 0;
+	uint8_t typematic = PS2_TYPEMATIC_DEFAULT;
+	bool pollFast = false;
 
 	uint32_t resetEventsLast = 0;
+	uint16_t reportsSuppressedLast = 0;
+	uint16_t reportsReplacedLast = 0;
 
 	while(1) {
 		uint32_t timestamp = timestampGet();
-		uint8_t modifierNew = 0;
-		uint32_t keycodeNew = 0;
-		uint8_t eventNew = 0;
 		bool newState = false;
-		bool overflow = ps2ReadPoll(&modifierNew, &keycodeNew, &eventNew);
+		bool overflow = ps2ReadStatus(timestamp);
 		if (overflow)
 		{
 			//emergency abort, to avoid mixig keycodes or ending up with non released keys
-			memset(keycodePressed, 0, MAXKEYS);
-			eventNew = 0;
-			keycodeNew = 0;
-			modifierNew = 0;
+			memset(keysPressed, 0, sizeof(keysPressed));
+			modifiers = 0;
 			newState = true;
 		}
-		if (eventNew == 1) { //press
-			fallbackTimeout = timestamp + 60000; //the keyboard will start repeats after 500ms
-			if ((keycodeNew) && (ignoreStrangePs2(keycodeNew) == false)) {
-				bool updated = false;
-				for (uint8_t i = 0; i < MAXKEYS; i++) {
-					if (keycodePressed[i] == keycodeNew) {
-						printf_P(PSTR("Update existing 0x%lx\r\n"), (unsigned long)keycodeNew);
-						updated = true;
-						break;
-					}
-				}
-				if (updated == false) {
-					for (uint8_t i = 0; i < MAXKEYS; i++) {
-						if (keycodePressed[i] == 0) {
-							printf_P(PSTR("Press 0x%x-0x%lx\r\n"), modifierNew, (unsigned long)keycodeNew);
-							keycodePressed[i] = keycodeNew;
-							newState = true;
-							break;
-						}
-					}
-				}
-			}
-			if (modifierNew != modifierOld) {
-				newState = true;
-			}
+		char debugCmd = g_lastDebug;
+		if ((debugCmd == '2') || (debugCmd == '3')) {
+			g_lastDebug = 0;
+			ps2SetCodeSet(debugCmd - '0');
+		} else if (debugCmd == 'f') {
+			g_lastDebug = 0;
+			pollFast = !pollFast;
+			printf_P(PSTR("Poll interval %ums, used after the next USB reset\r\n"), pollFast ? POLLINTERVAL_FAST : POLLINTERVAL);
+			UsbSetPollInterval(pollFast);
+		} else if (debugCmd == 'r') {
+			g_lastDebug = 0;
+			typematic = (typematic == PS2_TYPEMATIC_OFF) ? PS2_TYPEMATIC(1, 0x0B) : PS2_TYPEMATIC_OFF;
+			printf_P(PSTR("Typematic 0x%x\r\n"), typematic);
+			ps2SetTypematic(typematic);
 		}
-		if (eventNew == 2) { //release
-			if ((keycodeNew) && (ignoreStrangePs2(keycodeNew) == false)) {
-				bool found = false;
-				for (uint8_t i = 0; i < MAXKEYS; i++) {
-					if (keycodePressed[i] == keycodeNew) {
-						printf_P(PSTR("Release 0x%lx\r\n"), (unsigned long)keycodeNew);
-						found = true;
-						keycodePressed[i] = 0;
-						if (g_Macro.mode != 1) { //dont intercept a replay by releasing the replay key
-							newState = true;
-						}
-						break;
-					}
-				}
-				if (!found) {
-					printf_P(PSTR("Release 0x%x not in list!\r\n"), (unsigned long)keycodeNew);
-				}
+		ps2event_t event;
+		while (ps2ReadPoll(&event)) { //all pending events in one pass
+			if (event.type == PS2EVENT_PRESS) {
+				fallbackTimeout = timestamp + 60000; //the keyboard might repeat after 250ms..1s
 			}
-			if (modifierNew != modifierOld) {
-				newState = true;
+			//dont intercept a replay by releasing the replay key
+			if (keyEventApply(keysPressed, &modifiers, &event, g_Macro.mode != 1)) {
+				//every state change is queued, see g_reportQueue
+				if (UpdateUsbKeystate(keysPressed, modifiers)) {
+					UsbWakeupHost();
+				}
+				newState = false;
 			}
 		}
 		if (macroExecute(timestamp))
@@ -1037,14 +1308,31 @@ int main(void) {
 			   So this is limited to one minute safety timeout for decisions...
 			*/
 			printf_P(PSTR("Clear all keys\r\n"));
-			memset(keycodePressed, 0, MAXKEYS);
-			modifierNew = 0;
+			memset(keysPressed, 0, sizeof(keysPressed));
+			modifiers = 0;
 			newState = true;
 			fallbackTimeout = 0xFFFFFFFF;
 		}
+		if (g_UpdateReport) {
+			g_UpdateReport = 0;
+			newState = true;
+		}
+		if ((g_idleResend) && (!newState)) {
+			cli();
+			uint8_t resend = g_idleResend;
+			g_idleResend = 0;
+			sei();
+			for (uint8_t reportId = REPORTID_KEYBOARD; reportId < HIDREPORTIDS; reportId++) {
+				if ((resend & (1 << reportId)) &&
+				    ((!g_bootProtocol) || (reportId == REPORTID_KEYBOARD))) {
+					UsbReportResend(reportId);
+				}
+			}
+		}
 		if (newState) {
-			UpdateUsbKeystate(keycodePressed, modifierNew);
-			modifierOld = modifierNew;
+			if (UpdateUsbKeystate(keysPressed, modifiers)) {
+				UsbWakeupHost();
+			}
 		}
 		if ((g_UpdateLed) && (g_Macro.mode == 0))
 		{
@@ -1054,12 +1342,21 @@ int main(void) {
 			sei();
 			ps2SetLeds(newLedState);
 		}
-		if (timestamp > check) {
+		bool suspended = USBNSuspended();
+		if ((timestamp > check) && (!suspended)) {
 			printf_P(PSTR("Ping\r\n"));
 			check = timestamp + 3000UL;
+			if (g_reportsSuppressed != reportsSuppressedLast) {
+				printf_P(PSTR("Reports suppressed: %u\r\n"), g_reportsSuppressed);
+				reportsSuppressedLast = g_reportsSuppressed;
+			}
+			if (g_reportsReplaced != reportsReplacedLast) {
+				printf_P(PSTR("Reports replaced, queue full: %u\r\n"), g_reportsReplaced);
+				reportsReplacedLast = g_reportsReplaced;
+			}
 			//printf_P(PSTR("%lu\r\n"), timestamp);
 		}
-		if (g_BlinkMode) {
+		if ((g_BlinkMode) && (!suspended)) {
 			if (blinkTimeout < timestamp) {
 				if (blinkToggle) {
 					ps2SetLeds(0x7 ^ g_LedByHost);
@@ -1071,7 +1368,7 @@ int main(void) {
 				blinkTimeout = timestamp + 50;
 			}
 		}
-		if (timestamp > blink) {
+		if ((timestamp > blink) && (!suspended)) {
 			toggle = 1 - toggle;
 			if (toggle) {
 				PORTA |= (1 << PA4);
@@ -1086,5 +1383,11 @@ int main(void) {
 			resetEventsLast = resetEventsNow;
 		}
 		wdt_reset();
+		if ((suspended) && (g_Macro.mode == 0)) {
+			UsbSuspendSleep();
+			if (!USBNSuspended()) {
+				ps2KbdRecheck(); //woken up by the resume
+			}
+		}
 	}
 }
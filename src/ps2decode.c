@@ -0,0 +1,364 @@
+/*
+PS/2 scancode decoder, converts the bytes received from the keyboard into
+key events. Does not access any hardware, so it can be compiled for other
+targets too.
+
+Copyright (C) 2020 Malte Marwedel
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "ps2decode.h"
+
+/* Single producer (PS/2 interrupt), single consumer (main loop), no locking
+   required. The indices are free running, the number of entries is
+   write - read and the slot is index & (EVENTENTRIES - 1). So the size must be
+   a power of two and not larger than 128.
+*/
+volatile ps2event_t g_events[EVENTENTRIES];
+volatile uint8_t g_eventsWrite; //only modified within the interrupt
+volatile uint8_t g_eventsRead; //only modified by the main loop
+volatile uint8_t g_eventsDropped; //key events lost, the buffer was full
+volatile uint8_t g_eventsHighWater; //maximum number of events queued
+
+//set when key events were lost, the main loop then releases all keys
+volatile uint8_t g_rxOverflow;
+
+//drop the next key event, see ps2DecodeLost and ps2DecodeLostEnd. Only used within the interrupt
+static bool g_decodeSkip;
+
+#if ((EVENTENTRIES & (EVENTENTRIES - 1)) || (EVENTENTRIES > 128))
+#error "EVENTENTRIES must be a power of two <= 128"
+#endif
+
+//only called within the interrupt
+static void ps2EventPut(uint8_t key, uint8_t type)
+{
+	if (g_decodeSkip)
+	{
+		g_decodeSkip = false; //see ps2DecodeLost
+		return;
+	}
+	uint8_t write = g_eventsWrite;
+	uint8_t used = write - g_eventsRead;
+	if (used < EVENTENTRIES)
+	{
+		g_events[write & (EVENTENTRIES - 1)].key = key;
+		g_events[write & (EVENTENTRIES - 1)].type = type;
+		g_eventsWrite = write + 1;
+		used++;
+		if (used > g_eventsHighWater)
+		{
+			g_eventsHighWater = used;
+		}
+	}
+	else
+	{
+		g_eventsDropped++;
+		g_rxOverflow = 1;
+	}
+}
+/* Scancode set 2 decoder, table driven.
+   Each received byte is sorted into a class, then the table gives the next
+   state and what to do with the byte. Pause is the only key using E1:
+   E1 14 77 is reported as press, E1 F0 14 F0 77 as release.
+*/
+#define DEC_IDLE     0
+#define DEC_BREAK    1
+#define DEC_E0       2
+#define DEC_E0BREAK  3
+#define DEC_E1       4
+#define DEC_E1BREAK  5
+#define DEC_STATES   6
+
+#define CLS_CODE 0
+#define CLS_F0   1
+#define CLS_E0   2
+#define CLS_E1   3
+#define CLS_14   4
+#define CLS_77   5
+#define CLS_NUM  6
+
+//upper nibble of a table entry
+#define ACT_NONE        0x00
+#define ACT_PRESS       0x10
+#define ACT_RELEASE     0x20
+#define ACT_PRESS_E0    0x30
+#define ACT_RELEASE_E0  0x40
+#define ACT_PRESS_E1    0x50
+#define ACT_RELEASE_E1  0x60
+
+static const uint8_t g_ps2DecodeTable[DEC_STATES][CLS_NUM] PROGMEM = {
+	//  CODE                      F0           E0      E1           0x14                        0x77
+	{DEC_IDLE | ACT_PRESS,      DEC_BREAK,   DEC_E0, DEC_E1,      DEC_IDLE | ACT_PRESS,       DEC_IDLE | ACT_PRESS},       //DEC_IDLE
+	{DEC_IDLE | ACT_RELEASE,    DEC_BREAK,   DEC_E0, DEC_E1,      DEC_IDLE | ACT_RELEASE,     DEC_IDLE | ACT_RELEASE},     //DEC_BREAK
+	{DEC_IDLE | ACT_PRESS_E0,   DEC_E0BREAK, DEC_E0, DEC_E1,      DEC_IDLE | ACT_PRESS_E0,    DEC_IDLE | ACT_PRESS_E0},    //DEC_E0
+	{DEC_IDLE | ACT_RELEASE_E0, DEC_E0BREAK, DEC_E0, DEC_E1,      DEC_IDLE | ACT_RELEASE_E0,  DEC_IDLE | ACT_RELEASE_E0},  //DEC_E0BREAK
+	{DEC_IDLE,                  DEC_E1BREAK, DEC_E0, DEC_E1,      DEC_E1,                     DEC_IDLE | ACT_PRESS_E1},    //DEC_E1
+	{DEC_IDLE,                  DEC_E1BREAK, DEC_E0, DEC_E1BREAK, DEC_E1BREAK,                DEC_IDLE | ACT_RELEASE_E1},  //DEC_E1BREAK
+};
+
+static uint8_t g_decodeState = DEC_IDLE; //only used within the interrupt
+
+//only called within the interrupt
+static void ps2DecodeSet2(uint8_t scancode)
+{
+	uint8_t cls;
+	switch (scancode)
+	{
+		case 0xF0: cls = CLS_F0; break;
+		case 0xE0: cls = CLS_E0; break;
+		case 0xE1: cls = CLS_E1; break;
+		case 0x14: cls = CLS_14; break;
+		case 0x77: cls = CLS_77; break;
+		case 0x00: //key detection error or internal buffer overrun of the keyboard
+		case 0xFF:
+			g_rxOverflow = 1;
+			g_decodeState = DEC_IDLE;
+			return;
+		default: cls = CLS_CODE;
+	}
+	uint8_t entry = pgm_read_byte(&g_ps2DecodeTable[g_decodeState][cls]);
+	g_decodeState = entry & 0x0F;
+	uint8_t key = scancode;
+	switch (entry & 0xF0)
+	{
+		case ACT_PRESS:
+		case ACT_RELEASE:
+			//the only two codes above 0x7F are folded into unused codes
+			if (scancode == 0x83)
+			{
+				key = PS2_KEY_F7;
+			}
+			else if (scancode == 0x84)
+			{
+				key = PS2_KEY_SYSRQ;
+			}
+			else if (scancode & 0x80) //0xAA, 0xFC... no key
+			{
+				return;
+			}
+			ps2EventPut(key, ((entry & 0xF0) == ACT_PRESS) ? PS2EVENT_PRESS : PS2EVENT_RELEASE);
+			break;
+		case ACT_PRESS_E0:
+		case ACT_RELEASE_E0:
+			if (scancode & 0x80)
+			{
+				return;
+			}
+			ps2EventPut(PS2_E0(scancode), ((entry & 0xF0) == ACT_PRESS_E0) ? PS2EVENT_PRESS : PS2EVENT_RELEASE);
+			break;
+		case ACT_PRESS_E1:
+			ps2EventPut(PS2_KEY_PAUSE, PS2EVENT_PRESS);
+			break;
+		case ACT_RELEASE_E1:
+			ps2EventPut(PS2_KEY_PAUSE, PS2EVENT_RELEASE);
+			break;
+		default:
+			break;
+	}
+}
+//Set 3 make codes, converted to the key ids of set 2. 0 = not supported.
+static const uint8_t g_ps2Set3Table[0x8E] PROGMEM = {
+	[0x07] = 0x05, //F1
+	[0x08] = 0x76, //Esc
+	[0x0D] = 0x0D, //Tab
+	[0x0E] = 0x0E, //`
+	[0x0F] = 0x06, //F2
+	[0x11] = 0x14, //left control
+	[0x12] = 0x12, //left shift
+	[0x13] = 0x61, //< > of the ISO layout
+	[0x14] = 0x58, //caps lock
+	[0x15] = 0x15, //Q
+	[0x16] = 0x16, //1
+	[0x17] = 0x04, //F3
+	[0x19] = 0x11, //left alt
+	[0x1A] = 0x1A, //Z
+	[0x1B] = 0x1B, //S
+	[0x1C] = 0x1C, //A
+	[0x1D] = 0x1D, //W
+	[0x1E] = 0x1E, //2
+	[0x1F] = 0x0C, //F4
+	[0x21] = 0x21, //C
+	[0x22] = 0x22, //X
+	[0x23] = 0x23, //D
+	[0x24] = 0x24, //E
+	[0x25] = 0x25, //4
+	[0x26] = 0x26, //3
+	[0x27] = 0x03, //F5
+	[0x29] = 0x29, //space
+	[0x2A] = 0x2A, //V
+	[0x2B] = 0x2B, //F
+	[0x2C] = 0x2C, //T
+	[0x2D] = 0x2D, //R
+	[0x2E] = 0x2E, //5
+	[0x2F] = 0x0B, //F6
+	[0x31] = 0x31, //N
+	[0x32] = 0x32, //B
+	[0x33] = 0x33, //H
+	[0x34] = 0x34, //G
+	[0x35] = 0x35, //Y
+	[0x36] = 0x36, //6
+	[0x37] = PS2_KEY_F7,
+	[0x39] = PS2_E0(0x11), //right alt
+	[0x3A] = 0x3A, //M
+	[0x3B] = 0x3B, //J
+	[0x3C] = 0x3C, //U
+	[0x3D] = 0x3D, //7
+	[0x3E] = 0x3E, //8
+	[0x3F] = 0x0A, //F8
+	[0x41] = 0x41, //,
+	[0x42] = 0x42, //K
+	[0x43] = 0x43, //I
+	[0x44] = 0x44, //O
+	[0x45] = 0x45, //0
+	[0x46] = 0x46, //9
+	[0x47] = 0x01, //F9
+	[0x49] = 0x49, //.
+	[0x4A] = 0x4A, ///
+	[0x4B] = 0x4B, //L
+	[0x4C] = 0x4C, //;
+	[0x4D] = 0x4D, //P
+	[0x4E] = 0x4E, //-
+	[0x4F] = 0x09, //F10
+	[0x52] = 0x52, //'
+	[0x53] = 0x5D, //# of the ISO layout
+	[0x54] = 0x54, //[
+	[0x55] = 0x55, //=
+	[0x56] = 0x78, //F11
+	[0x57] = PS2_E0(0x7C), //print screen
+	[0x58] = PS2_E0(0x14), //right control
+	[0x59] = 0x59, //right shift
+	[0x5A] = 0x5A, //enter
+	[0x5B] = 0x5B, //]
+	[0x5C] = 0x5D, //backslash
+	[0x5E] = 0x07, //F12
+	[0x5F] = 0x7E, //scroll lock
+	[0x60] = PS2_E0(0x72), //down
+	[0x61] = PS2_E0(0x6B), //left
+	[0x62] = PS2_KEY_PAUSE,
+	[0x63] = PS2_E0(0x75), //up
+	[0x64] = PS2_E0(0x71), //delete
+	[0x65] = PS2_E0(0x69), //end
+	[0x66] = 0x66, //backspace
+	[0x67] = PS2_E0(0x70), //insert
+	[0x69] = 0x69, //keypad 1
+	[0x6A] = PS2_E0(0x74), //right
+	[0x6B] = 0x6B, //keypad 4
+	[0x6C] = 0x6C, //keypad 7
+	[0x6D] = PS2_E0(0x7A), //page down
+	[0x6E] = PS2_E0(0x6C), //home
+	[0x6F] = PS2_E0(0x7D), //page up
+	[0x70] = 0x70, //keypad 0
+	[0x71] = 0x71, //keypad .
+	[0x72] = 0x72, //keypad 2
+	[0x73] = 0x73, //keypad 5
+	[0x74] = 0x74, //keypad 6
+	[0x75] = 0x75, //keypad 8
+	[0x76] = 0x77, //num lock
+	[0x77] = PS2_E0(0x4A), //keypad /
+	[0x79] = PS2_E0(0x5A), //keypad enter
+	[0x7A] = 0x7A, //keypad 3
+	[0x7C] = 0x79, //keypad +
+	[0x7D] = 0x7D, //keypad 9
+	[0x7E] = 0x7C, //keypad *
+	[0x84] = 0x7B, //keypad -
+	[0x8B] = PS2_E0(0x1F), //left GUI
+	[0x8C] = PS2_E0(0x27), //right GUI
+	[0x8D] = PS2_E0(0x2F), //menu
+};
+
+/* Scancode set 3 decoder. After F8 every key sends its make code when pressed
+   and F0 + make code when released, there are no prefixes and no repeats.
+*/
+static void ps2DecodeSet3(uint8_t scancode)
+{
+	if (scancode == 0xF0)
+	{
+		g_decodeState = DEC_BREAK;
+		return;
+	}
+	if ((scancode == 0x00) || (scancode == 0xFF)) //key detection error or overrun
+	{
+		g_rxOverflow = 1;
+		g_decodeState = DEC_IDLE;
+		return;
+	}
+	uint8_t type = (g_decodeState == DEC_BREAK) ? PS2EVENT_RELEASE : PS2EVENT_PRESS;
+	g_decodeState = DEC_IDLE;
+	if (scancode < sizeof(g_ps2Set3Table))
+	{
+		uint8_t key = pgm_read_byte(&g_ps2Set3Table[scancode]);
+		if (key)
+		{
+			ps2EventPut(key, type);
+		}
+	}
+}
+
+//only called within the interrupt
+void ps2DecodeByte(uint8_t codeSet, uint8_t scancode)
+{
+	if (codeSet == 3)
+	{
+		ps2DecodeSet3(scancode);
+	}
+	else
+	{
+		ps2DecodeSet2(scancode);
+	}
+}
+
+//only called within the interrupt
+void ps2DecodeReset(void)
+{
+	g_decodeState = DEC_IDLE;
+	g_decodeSkip = false;
+}
+
+//only called within the interrupt
+void ps2DecodeLost(void)
+{
+	g_decodeState = DEC_IDLE;
+	g_decodeSkip = true;
+	g_rxOverflow = 1;
+}
+
+//only called within the interrupt
+void ps2DecodeLostEnd(void)
+{
+	g_decodeSkip = false;
+}
+
+bool ps2EventGet(ps2event_t * event)
+{
+	uint8_t read = g_eventsRead;
+	if (read == g_eventsWrite)
+	{
+		return false;
+	}
+	event->key = g_events[read & (EVENTENTRIES - 1)].key;
+	event->type = g_events[read & (EVENTENTRIES - 1)].type;
+	g_eventsRead = read + 1;
+	return true;
+}
+
+bool ps2EventAvailable(void)
+{
+	return (g_eventsRead != g_eventsWrite);
+}
@@ -0,0 +1,73 @@
+#pragma once
+/*
+PS/2 scancode decoder, converts the bytes received from the keyboard into
+key events.
+
+Copyright (C) 2020 Malte Marwedel
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*Key ids used by the key events:
+  0x01..0x7F: set 2 scancode without prefix
+  0x81..0xFF: set 2 scancode with E0 prefix
+  The codes 0x83 (F7), 0x84 (Alt + print screen) and the E1 sequence of pause
+  are folded into codes not used by the keyboard.
+*/
+#define PS2_E0(code) (0x80 | (code))
+#define PS2_KEY_F7 0x02
+#define PS2_KEY_SYSRQ 0x7F
+#define PS2_KEY_PAUSE PS2_E0(0x00)
+
+#define PS2EVENT_PRESS 1
+#define PS2EVENT_RELEASE 2
+
+typedef struct {
+	uint8_t key;
+	uint8_t type; //PS2EVENT_PRESS or PS2EVENT_RELEASE
+} ps2event_t;
+
+//size of the event ring, must be a power of two
+#define EVENTENTRIES 32
+
+extern volatile uint8_t g_eventsDropped; //key events lost, the buffer was full
+extern volatile uint8_t g_eventsHighWater; //maximum number of events queued
+//set when key events were lost, the main loop then releases all keys
+extern volatile uint8_t g_rxOverflow;
+
+//decodes one byte of code set 2 or 3, only call from the PS/2 interrupt
+void ps2DecodeByte(uint8_t codeSet, uint8_t scancode);
+
+//drops a partially received sequence, only call from the PS/2 interrupt
+void ps2DecodeReset(void);
+
+/*A frame got lost, only call from the PS/2 interrupt. Like ps2DecodeReset,
+  but the main loop releases all keys by g_rxOverflow, as the lost byte could
+  have been a release. The next key event is dropped until ps2DecodeLostEnd,
+  it could be the rest of the lost sequence, e.g. 1C of F0 1C would be a press.
+*/
+void ps2DecodeLost(void);
+
+//the rest of the lost sequence would have arrived by now, only call from the PS/2 interrupt
+void ps2DecodeLostEnd(void);
+
+//returns true if there was a key event
+bool ps2EventGet(ps2event_t * event);
+
+//returns true if ps2EventGet would return an event
+bool ps2EventAvailable(void);
@@ -24,9 +24,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "main.h"
-#include <util/delay.h>
 
 #include "ps2kbd.h"
 
@@ -51,56 +51,142 @@ volatile uint8_t send_parity = 0;
 volatile uint8_t send_byte = 0;
 volatile uint8_t parity_errors = 0; // Currently unused but will provide error info to host computer
 volatile uint8_t framing_errors = 0;
+volatile bool g_resync; //true after a framing error until the bus was idle
+volatile bool g_lostSequence; //a frame got lost, the following ones may be the rest of its sequence
 volatile uint8_t g_requestResend; //set to 1, if a parity error occured
-volatile uint8_t g_NextByteIsAct; //only used within the int routine
 volatile enum ps2state mode = KEY;
 volatile enum rxtxstate sr = RX;
 
-#define BUFFERENTRIES 32
+/* Host to device commands are queued by the main loop and then sent by
+   the interrupts. Timer2 times the bus idle wait, the clock inhibit, the
+   request to send and the timeouts, the PS/2 clock interrupt sends the bits
+   and receives the ACK.
+*/
+#define PS2TXQUEUEENTRIES 8
+
+//Timer2 runs with a divider of 1024 -> 64us per tick
+#define PS2TIMERTICKS(us) ((uint8_t)(((us) + 63) / 64))
+
+//the keyboard must not have sent a clock within the last 1ms before sending
+#define PS2TX_IDLETICKS PS2TIMERTICKS(1000)
+//the clock must be hold low for at least 100us
+#define PS2TX_INHIBITTICKS PS2TIMERTICKS(150)
+//data must be low before the clock is released, one tick instead of waiting within the interrupt
+#define PS2TX_REQUESTTICKS PS2TIMERTICKS(10)
+//~16ms for the keyboard to clock in the byte and another ~16ms for the ACK
+#define PS2TX_TIMEOUTTICKS 255
+
+#define PS2TX_TRIES 3
+
+/* After a framing error the position within the frame is unknown. All clock
+   edges are ignored until Timer0 sees the clock idle for longer than a clock
+   period (max 100us), the next falling edge is then a start bit again.
+   Timer0 also runs within every received frame, so a frame missing a clock
+   edge is dropped once the keyboard stops clocking, before the next frame.
+   Timer0 runs with a divider of 64 -> 4us per tick.
+*/
+#define PS2RESYNC_TICKS (200 / 4)
+
+/* The bytes of one scancode sequence follow each other within ~1ms, while
+   the keyboard scans its matrix only every few ms. So a frame starting
+   within PS2SEQUENCE_TICKS after a lost one continues its sequence, later
+   frames are new key events. Timer0 runs with a divider of 1024 -> 64us per tick.
+*/
+#define PS2SEQUENCE_TICKS (3000 / 64)
+
+typedef struct {
+	uint8_t data[2];
+	uint8_t len;
+} ps2cmd_t;
+
+volatile ps2cmd_t g_txQueue[PS2TXQUEUEENTRIES];
+volatile uint8_t g_txQueueRead; //only modified within the interrupts or with them disabled
+volatile uint8_t g_txQueueWrite; //only modified by the main loop
+volatile uint8_t g_txIndex; //byte of the current command which is sent
+volatile uint8_t g_txTries;
+volatile enum ps2txstate g_txState = TXIDLE;
+volatile uint8_t g_txFailed; //number of commands without any answer, printed by the main loop
+volatile uint8_t g_txRefused; //number of commands the keyboard did not accept, printed by the main loop
+volatile uint8_t g_txRefusedCmd[2]; //the last refused command and its argument
+volatile bool g_txAnswered; //a clock from the keyboard has been seen while waiting for the ACK
+
+/* Single producer (PS/2 interrupt), single consumer (main loop), no locking
+   required. The indices are free running, the number of entries is
+   write - read and the slot is index & (BUFFERENTRIES - 1). So the size must be
+   a power of two and not larger than 128.
+*/
 
-//by definition, no zeros are filled in the buffer, so zeros mean empty
-volatile uint8_t g_rxbuffer[BUFFERENTRIES]; //must be an atomic writeable datatype
-uint8_t g_rxbufferRead;
-volatile uint8_t g_rxbufferWrite;
-volatile uint8_t g_rxOverflow;
-volatile uint8_t g_rxAct; //dont put act data into the common control flow
+//only responses to commands are stored here, key codes are decoded within the interrupt
+#define BUFFERENTRIES 8
 
-uint8_t ps2RxGet(void)
+volatile uint8_t g_rxbuffer[BUFFERENTRIES];
+volatile uint8_t g_rxbufferWrite; //only modified within the interrupt
+volatile uint8_t g_rxbufferRead; //only modified by the main loop
+volatile uint8_t g_rxDropped; //responses lost, the buffer was full
+
+#if ((BUFFERENTRIES & (BUFFERENTRIES - 1)) || (BUFFERENTRIES > 128))
+#error "BUFFERENTRIES must be a power of two <= 128"
+#endif
+
+static bool ps2RxGet(uint8_t * data)
 {
-	uint8_t val = g_rxbuffer[g_rxbufferRead];
-	if (val)
+	uint8_t read = g_rxbufferRead;
+	if (read == g_rxbufferWrite)
 	{
-		g_rxbuffer[g_rxbufferRead] = 0;
-		g_rxbufferRead++;
-		if (g_rxbufferRead == BUFFERENTRIES)
-		{
-			g_rxbufferRead = 0;
-		}
+		return false;
 	}
-	return val;
+	*data = g_rxbuffer[read & (BUFFERENTRIES - 1)];
+	g_rxbufferRead = read + 1;
+	return true;
 }
 
-void ps2RxPut(uint8_t data)
+//only called within the interrupt
+static void ps2RxPut(uint8_t data)
 {
-	uint8_t val = g_rxbuffer[g_rxbufferWrite];
-	if (val == 0)
+	uint8_t write = g_rxbufferWrite;
+	if ((uint8_t)(write - g_rxbufferRead) < BUFFERENTRIES)
 	{
-		if (data)
-		{
-			g_rxbuffer[g_rxbufferWrite] = data;
-			g_rxbufferWrite++;
-			if (g_rxbufferWrite == BUFFERENTRIES)
-			{
-				g_rxbufferWrite = 0;
-			}
-		}
+		g_rxbuffer[write & (BUFFERENTRIES - 1)] = data;
+		g_rxbufferWrite = write + 1;
 	}
 	else
 	{
-		g_rxOverflow = 1;
+		g_rxDropped++;
 	}
 }
 
+/* Code set 3 is requested after a reset, if the keyboard does not support it,
+   set 2 is used. The decoder switches to the new set when the keyboard
+   acknowledged the command, the following query confirms the set.
+*/
+volatile uint8_t g_codeSet = 2; //set used by the decoder
+uint8_t g_codeSetWanted = 2; //only used by the main loop
+uint8_t g_codeSetSelected = PS2_CODESET; //requested after every keyboard reset
+volatile bool g_codeSetQuery; //the next received byte is the answer to F0 00
+volatile uint8_t g_codeSetReply; //answer of the keyboard, 0 = none
+
+uint8_t g_typematic = PS2_TYPEMATIC_DEFAULT; //only used by the main loop
+uint8_t g_leds; //restored after a keyboard reset
+
+/* The keyboard is (re)initialized by the main loop, so it can be plugged in
+   or swapped at any time without resetting the converter. An unsolicited
+   BAT completion (0xAA) means a keyboard was plugged in or did reset itself.
+   A command without any answer means the keyboard is gone, it is then reset
+   again with an increasing pause between the tries. A command answered with
+   FE or FC is only refused, the keyboard stays in use. An echo command is
+   sent periodically, so a removed keyboard is detected even without key
+   presses.
+*/
+#define PS2BAT_TIMEOUT 1000 //ms, the keyboard needs 500..750ms after a reset
+#define PS2PROBE_INTERVAL 500 //ms
+#define PS2BACKOFF_MIN 100 //ms
+#define PS2BACKOFF_MAX 1600 //ms
+
+volatile bool g_batReceived; //set by the interrupt on an unexpected 0xAA
+enum ps2kbdstate g_kbdState = KBDRESET; //only used by the main loop
+uint32_t g_kbdTimestamp; //start of the current state
+uint16_t g_kbdBackoff = PS2BACKOFF_MIN;
+
 int calc_parity(unsigned parity_x)
 {
   // Calculate Odd-Parity of byte needed to send PS/2 Packet
@@ -111,163 +197,578 @@ int calc_parity(unsigned parity_x)
   return parity_y & 1;
 }
 
+//only called within an interrupt or with interrupts disabled
+static void ps2ResyncStop(void)
+{
+	TCCR0 = 0;
+	g_resync = false;
+}
+
+//only called within an interrupt, Timer0 fires once the clock was idle for PS2RESYNC_TICKS
+static void ps2IdleTimerStart(void)
+{
+	TCNT0 = 0;
+	OCR0 = PS2RESYNC_TICKS;
+	TIFR = (1 << OCF0);
+	TCCR0 = (1 << WGM01) | (1 << CS01) | (1 << CS00); //CTC, divide by 64
+}
+
+//only called within an interrupt, Timer0 fires once no frame started within PS2SEQUENCE_TICKS
+static void ps2LostSequenceStart(void)
+{
+	g_lostSequence = true;
+	TCNT0 = 0;
+	OCR0 = PS2SEQUENCE_TICKS;
+	TIFR = (1 << OCF0);
+	TCCR0 = (1 << WGM01) | (1 << CS02) | (1 << CS00); //CTC, divide by 1024
+}
+
+//only called within an interrupt or with interrupts disabled, the next key event counts again
+static void ps2LostSequenceEnd(void)
+{
+	g_lostSequence = false;
+	ps2DecodeLostEnd();
+}
+
+/*only called within an interrupt
+  Drops the partial frame and a started multi byte sequence, the main loop
+  releases all keys, see ps2DecodeLost.
+*/
+static void ps2FrameLost(void)
+{
+	framing_errors++;
+	rcv_bitcount = 0;
+	rcv_byte = 0;
+	ps2DecodeLost();
+}
+
+//only called within an interrupt, waits for the bus to become idle
+static void framing_error(void)
+{
+	ps2FrameLost();
+	g_resync = true;
+	ps2IdleTimerStart();
+}
+
+ISR(TIMER0_COMP_vect)
+{
+	if ((!g_resync) && (rcv_bitcount == 0))
+	{
+		ps2LostSequenceEnd(); //no frame followed the lost one in time
+		ps2ResyncStop();
+		return;
+	}
+	if (!g_resync)
+	{
+		ps2FrameLost(); //the clock stopped within a frame, e.g. a missed edge
+	}
+	ps2ResyncStop(); //bus idle, the next edge starts a new frame
+	ps2LostSequenceStart();
+}
+
+static void ps2TimerStart(uint8_t ticks)
+{
+	TCCR2 = 0;
+	TCNT2 = 0;
+	OCR2 = ticks;
+	TIFR = (1 << OCF2);
+	TCCR2 = (1 << WGM21) | (1 << CS22) | (1 << CS21) | (1 << CS20); //CTC, divide by 1024
+}
+
+static void ps2TimerStop(void)
+{
+	TCCR2 = 0;
+}
+
+//only called within an interrupt or with interrupts disabled
+static void ps2TxInhibit(uint8_t data)
+{
+	GICR &= ~(1 << PS2INTENABLE); // Disable interrupt for CLK
+	PS2PORT &= ~(1 << PS2CLOCK); // Set Clock low
+	PS2DDR |= (1 << PS2CLOCK); // CLK low
+	send_byte = data;
+	rcv_bitcount = 0;
+	rcv_byte = 0;
+	ps2ResyncStop(); //the keyboard repeats an interrupted frame from its start
+	ps2LostSequenceEnd();
+	g_txState = TXINHIBIT;
+	ps2TimerStart(PS2TX_INHIBITTICKS);
+}
+
+/*only called within an interrupt or with interrupts disabled
+  Starts sending the next byte, if there is one.
+  If this is done in the middle of a byte from the device to the host, this
+  will be repeated later.
+  The catch: If this was a multi byte sequence, the whole sequence is repeated,
+  but our sequence interpreter statemachine cant handle this, and would end up
+  in wrong scancodes. So in order to avoid this, we wait with sending until the
+  keyboard is "idle", eg did not have sent a clock anything within the last 1ms.
+  If we then interrupt the keyboard at the beginning of the first byte, we can
+  count on the repeat logic.
+*/
+static void ps2TxStart(void)
+{
+	if (g_txQueueRead == g_txQueueWrite)
+	{
+		ps2TimerStop();
+		g_txState = TXIDLE;
+		return;
+	}
+	send_byte = g_txQueue[g_txQueueRead].data[g_txIndex];
+	if (send_byte == 0xFF) //no need to wait if the command is a reset
+	{
+		ps2TxInhibit(send_byte);
+	}
+	else
+	{
+		g_txState = TXWAITIDLE;
+		ps2TimerStart(PS2TX_IDLETICKS);
+	}
+}
+
 //only called within an interrupt
-void framing_error(uint8_t num)
-{
-  // Deal with PS/2 Protocol Framing errors. delay for the rest of the packet and clear interrupts generated during the delay.
-  framing_errors++;
-  GICR &= ~(1 << PS2INTENABLE);
-  sei();
-  _delay_ms(8);
-  cli();
-  GIFR |= (1 << PS2INTFLAG); // Clear Interrupt flag
-  GICR |= (1 << PS2INTENABLE);
-}
-
-void sendps2(uint8_t data)
-{
-/*  Send a PS/2 Packet.
-  Begin the request by making both inputs outputs, drag clock low for at least 100us then take data low and release clock.
-  the device will soon after start clocking in the data so make clk an input again and pay attention to the interrupt.
-  The device will clock in 1 start bit, 8 data bits, 1 parity bit then 1 stop bit. It will then ack by taking data low on the 12th clk (though this is currently ignored) and then it will respond with an 0xFA ACK
-
-  If this is done in the middle of a byte from the device to the hsot, this will be repeated later.
-  The catch: If this was a multi byte sequence, the whole sequence is repeated, but our sequence
-  interpreter statemachine cant handle this, and would end up in wrong scancodes. So in order to avoid this,
-  we wait with sending until the keyboard is "idle", eg did not have sent a clock anything within the last 1ms.
-  If we then interrupt the keyboard at the beginning of the first byte, we can count on the repeat logic.
- */
-	if (data != 0xFF) //no need to wait if the command is a reset
-	{
-		uint16_t idleCycles = 0;
-		uint16_t timeout = 0;
-		while (idleCycles < 500) //1ms, 2us loop
+static void ps2TxNext(void)
+{
+	g_txIndex++;
+	if (g_txIndex >= g_txQueue[g_txQueueRead].len)
+	{
+		if (g_txQueue[g_txQueueRead].data[0] == 0xF0) //code set command completed
 		{
-			if (rcv_bitcount == 0)
+			uint8_t set = g_txQueue[g_txQueueRead].data[1];
+			if (set == 0)
 			{
-				idleCycles++;
+				g_codeSetQuery = true;
 			}
 			else
 			{
-				idleCycles = 0;
-			}
-			timeout++;
-			if (timeout > 25000) //50ms
-			{
-				printf_P(PSTR("PS/2: Error, no idle state found\r\n"));
-				return;
+				g_codeSet = set;
+				ps2DecodeReset();
 			}
-			_delay_us(2.0);
 		}
+		g_txIndex = 0;
+		g_txQueueRead = (g_txQueueRead + 1) % PS2TXQUEUEENTRIES;
 	}
-	uint8_t send_tries = 3;
-	do
-	{
-		send_bitcount = 0;
-		send_byte = data;
-		send_parity = calc_parity(send_byte);
-		GICR &= ~(1 << PS2INTENABLE); // Disable interrupt for CLK
-#if 0
-		PS2PORT &= ~(1 << PS2DATA); // Set data Low
-		PS2DDR &= ~(1 << PS2DATA); // Data is an input signal
-		PS2PORT &= ~(1 << PS2CLOCK); // Set Clock low
-		PS2DDR |= (1 << PS2CLOCK); // CLK low
-		_delay_us(150);
-		PS2DDR |= (1 << PS2DATA); // DATA low
-		GIFR |= (1 << PS2INTFLAG);
-		sr = TX;
-		GICR |= (1 << PS2INTENABLE);
-		PS2DDR &= ~(1 << PS2CLOCK); // Release clock and set it as an input again, clear interrupt flags and re-enable the interrupts
-#else
-		PS2PORT &= ~(1 << PS2CLOCK); // Set Clock low
-		PS2DDR |= (1 << PS2CLOCK); // CLK low
-		_delay_us(150);
-		PS2PORT &= ~(1 << PS2DATA); // Set data Low
-		PS2DDR |= (1 << PS2DATA); // DATA low
-		_delay_us(10);
-		GIFR |= (1 << PS2INTFLAG);
-		sr = TX;
-		GICR |= (1 << PS2INTENABLE);
-		PS2DDR &= ~(1 << PS2CLOCK); // Release clock and set it as an input again, clear interrupt flags and re-enable the interrupts
-#endif
-		uint16_t timeout = 250;
-		while (sr == TX) { // All the work for sending the data is handled inside the interrupt
-			_delay_us(100); // Wait for ACK packet before proceeding
-			timeout--;
-		}
-		if (sr == TX)
-		{
-			printf("Ooops\r\n");
-		}
-		timeout = 250;
-		do {
-			_delay_us(100); // Wait for ACK packet before proceeding
-			timeout--;
-		}	while ((g_rxAct == 0) && (timeout));
-		send_tries--;
-		if (g_rxAct == 1)
+	g_txTries = PS2TX_TRIES;
+	ps2TxStart();
+}
+
+/*only called within an interrupt, gives up the current command
+  refused: the keyboard answered, but not with an ACK. Otherwise the keyboard
+  did not answer at all, the main loop then considers it lost.
+*/
+static void ps2TxDrop(bool refused)
+{
+	if (refused)
+	{
+		g_txRefused++;
+		g_txRefusedCmd[0] = g_txQueue[g_txQueueRead].data[0];
+		g_txRefusedCmd[1] = g_txQueue[g_txQueueRead].data[1];
+	}
+	else
+	{
+		g_txFailed++;
+	}
+	//drop the whole command, an argument without its command makes no sense
+	g_txIndex = 0;
+	g_txQueueRead = (g_txQueueRead + 1) % PS2TXQUEUEENTRIES;
+	g_txTries = PS2TX_TRIES;
+}
+
+/*only called within an interrupt. If the response is not an ack, resend up to 3 times.
+  noResponse: the keyboard did not clock in the byte or sent nothing afterwards
+*/
+static void ps2TxRetry(bool noResponse)
+{
+	g_txTries--;
+	if (g_txTries == 0)
+	{
+		if (g_requestResend)
 		{
-			g_rxAct = 0;
-			break;
+			//our resend request for a received byte, not a command
+			g_requestResend = 0;
+			g_txTries = PS2TX_TRIES;
+			if (noResponse)
+			{
+				g_txFailed++;
+			}
 		}
-		if (g_rxAct == 0)
+		else
 		{
-			printf_P(PSTR("Retry sending... no act\r\n"));
+			ps2TxDrop(!noResponse);
 		}
-		if (g_rxAct == 2)
+	}
+	if (g_requestResend)
+	{
+		ps2TxInhibit(0xFE);
+	}
+	else
+	{
+		ps2TxStart();
+	}
+}
+
+//only called within an interrupt, after the keyboard clocked in the last bit
+static void ps2TxSent(void)
+{
+	if (g_requestResend)
+	{
+		//the keyboard answers with the last byte again, not with an ACK
+		g_requestResend = 0;
+		g_txTries = PS2TX_TRIES;
+		ps2TxStart();
+	}
+	else
+	{
+		g_txAnswered = false;
+		g_txState = TXWAITACK;
+		ps2TimerStart(PS2TX_TIMEOUTTICKS);
+	}
+}
+
+ISR(TIMER2_COMP_vect)
+{
+	ps2TimerStop();
+	switch (g_txState)
+	{
+		case TXWAITIDLE:
+			ps2TxInhibit(send_byte);
+			break;
+		case TXINHIBIT:
+			/*  Send a PS/2 Packet.
+			  Begin the request by making both inputs outputs, drag clock low for at least 100us then take data low and release clock.
+			  the device will soon after start clocking in the data so make clk an input again and pay attention to the interrupt.
+			  The device will clock in 1 start bit, 8 data bits, 1 parity bit then 1 stop bit. It will then ack by taking data low on the 12th clk (though this is currently ignored) and then it will respond with an 0xFA ACK
+			*/
+			send_bitcount = 0;
+			send_parity = calc_parity(send_byte);
+			PS2PORT &= ~(1 << PS2DATA); // Set data Low
+			PS2DDR |= (1 << PS2DATA); // DATA low
+			g_txState = TXREQUEST;
+			ps2TimerStart(PS2TX_REQUESTTICKS);
+			break;
+		case TXREQUEST:
+			GIFR |= (1 << PS2INTFLAG);
+			sr = TX;
+			g_txState = TXSENDING;
+			GICR |= (1 << PS2INTENABLE);
+			PS2DDR &= ~(1 << PS2CLOCK); // Release clock and set it as an input again, clear interrupt flags and re-enable the interrupts
+			ps2TimerStart(PS2TX_TIMEOUTTICKS);
+			break;
+		case TXSENDING: //the keyboard did not clock in the data
+			send_bitcount = 0;
+			sr = RX;
+			PS2DDR &= ~(1 << PS2CLOCK | 1 << PS2DATA); // Clock and Data set back to input
+			rcv_bitcount = 0;
+			ps2TxRetry(true);
+			break;
+		case TXWAITACK: //no ACK received
+			ps2TxRetry(!g_txAnswered);
+			break;
+		default:
+			break;
+	}
+}
+
+/*Queues a command with an optional argument byte.
+  replace: If the last queued command is the same and its argument has not
+  been sent yet, just update the argument. Avoids piling up LED updates.
+*/
+static bool ps2CmdQueue(uint8_t cmd, uint8_t arg, uint8_t len, bool replace)
+{
+	bool queued = false;
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t write = g_txQueueWrite;
+	uint8_t last = (write + PS2TXQUEUEENTRIES - 1) % PS2TXQUEUEENTRIES;
+	if ((replace) && (write != g_txQueueRead) && (g_txQueue[last].data[0] == cmd) &&
+	    ((last != g_txQueueRead) || (g_txIndex == 0)))
+	{
+		g_txQueue[last].data[1] = arg;
+		queued = true;
+	}
+	else
+	{
+		uint8_t next = (write + 1) % PS2TXQUEUEENTRIES;
+		if (next != g_txQueueRead)
 		{
-			g_rxAct = 0;
-			printf_P(PSTR("Retry sending... bad parity\r\n"));
+			g_txQueue[write].data[0] = cmd;
+			g_txQueue[write].data[1] = arg;
+			g_txQueue[write].len = len;
+			g_txQueueWrite = next;
+			if (g_txState == TXIDLE)
+			{
+				g_txTries = PS2TX_TRIES;
+				ps2TxStart();
+			}
+			queued = true;
 		}
-		wdt_reset();
-	} while (send_tries); // If the response is not an ack, resend up to 3 times.
-	g_rxAct = 0;
-	_delay_us(150);
-}
-
-int getresponse(void) {
-		mode = COMMAND;
-		uint8_t scancode;
-		uint16_t timeout = 7000;
-		do {
-			scancode = ps2RxGet();
-			timeout--;
-			_delay_us(100);
-		} while ((scancode == 0) && (timeout));
-		mode = KEY;
-		return scancode;
-}
-
-void resetKbd(void) {
-	printf_P(PSTR("Check PS/2 keyboard...\r\n"));
-	sendps2(0xff); // reset kbd
-	printf_P(PSTR("Send done\r\n"));
-	uint8_t resp = getresponse();
-	if (resp != 0xAA) {
-		printf_P(PSTR("PS/2 Invalid response 0x%x... resetting\r\n"), resp);
-		while (1) {} // Trigger WDT Reset
-	}
-	sendps2(0xf0); // Set Codeset
-	sendps2(0x02); // Codeset 2
+	}
+	SREG = sreg;
+	if (!queued)
+	{
+		printf_P(PSTR("PS/2: Error, command queue full\r\n"));
+	}
+	return queued;
+}
+
+//drops all queued commands and aborts a running transfer, used when the keyboard is gone
+static void ps2TxFlush(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	ps2TimerStop();
+	PS2DDR &= ~(1 << PS2CLOCK | 1 << PS2DATA); // Clock and Data set back to input
+	sr = RX;
+	send_bitcount = 0;
+	rcv_bitcount = 0;
+	rcv_byte = 0;
+	ps2ResyncStop();
+	ps2LostSequenceEnd();
+	g_requestResend = 0;
+	g_txIndex = 0;
+	g_txQueueRead = g_txQueueWrite;
+	g_txState = TXIDLE;
+	GIFR |= (1 << PS2INTFLAG);
+	GICR |= (1 << PS2INTENABLE); //might have been disabled by an inhibit
+	SREG = sreg;
+}
+
+//a keyboard finished its self test, bring it into our configuration
+static void ps2KbdConfigure(uint32_t timestamp)
+{
+	mode = KEY;
+	g_codeSet = 2; //default after a reset
+	ps2SetCodeSet(g_codeSetSelected);
+	ps2SetTypematic(g_typematic);
+	ps2SetLeds(g_leds);
+	g_kbdBackoff = PS2BACKOFF_MIN;
+	g_kbdState = KBDREADY;
+	g_kbdTimestamp = timestamp;
+}
+
+static void ps2KbdLost(uint32_t timestamp)
+{
+	ps2TxFlush();
+	mode = KEY; //a newly plugged keyboard reports 0xAA
+	g_kbdState = KBDLOST;
+	g_kbdTimestamp = timestamp;
+}
+
+//returns true if the keyboard has been removed or replaced
+static bool ps2KbdProcess(uint32_t timestamp, bool failed)
+{
+	uint8_t data;
+	bool changed = false;
+	switch (g_kbdState)
+	{
+		case KBDRESET:
+			printf_P(PSTR("PS/2: Reset keyboard\r\n"));
+			mode = COMMAND; //the interrupt stores all bytes in the rx buffer, instead of decoding them
+			while (ps2RxGet(&data)); //old responses
+			g_batReceived = false;
+			ps2CmdQueue(0xFF, 0, 1, false);
+			g_kbdState = KBDWAITBAT;
+			g_kbdTimestamp = timestamp;
+			break;
+		case KBDWAITBAT:
+			if ((ps2RxGet(&data)) && (data == 0xAA))
+			{
+				printf_P(PSTR("PS/2: Keyboard ready\r\n"));
+				ps2KbdConfigure(timestamp);
+			}
+			else if ((failed) || ((timestamp - g_kbdTimestamp) >= PS2BAT_TIMEOUT))
+			{
+				printf_P(PSTR("PS/2: No keyboard, retry in %ums\r\n"), g_kbdBackoff);
+				ps2KbdLost(timestamp);
+			}
+			break;
+		case KBDREADY:
+			if (g_batReceived)
+			{
+				g_batReceived = false;
+				printf_P(PSTR("PS/2: Keyboard attached\r\n"));
+				ps2TxFlush();
+				ps2KbdConfigure(timestamp);
+				changed = true;
+			}
+			else if (failed)
+			{
+				printf_P(PSTR("PS/2: Keyboard lost\r\n"));
+				ps2KbdLost(timestamp);
+				changed = true;
+			}
+			else if ((timestamp - g_kbdTimestamp) >= PS2PROBE_INTERVAL)
+			{
+				if (g_txState == TXIDLE)
+				{
+					ps2CmdQueue(0xEE, 0, 1, false); //echo
+				}
+				g_kbdTimestamp = timestamp;
+			}
+			break;
+		case KBDLOST:
+			if (g_batReceived)
+			{
+				g_batReceived = false;
+				printf_P(PSTR("PS/2: Keyboard attached\r\n"));
+				ps2KbdConfigure(timestamp);
+			}
+			else if ((timestamp - g_kbdTimestamp) >= g_kbdBackoff)
+			{
+				if (g_kbdBackoff < PS2BACKOFF_MAX)
+				{
+					g_kbdBackoff *= 2;
+				}
+				g_kbdState = KBDRESET;
+			}
+			break;
+	}
+	return changed;
 }
 
 void parity_error(void)
 {
 	parity_errors++;
-#if 0
-  //this cant work in an interrupt...
-  //sendps2(0xFE); // Inform the KBD of the Parity error and request a resend.
-#else
-	//disable sending, and request a resend command by the poll function
-	PS2PORT &= ~(1 << PS2DATA); // Set data Low
-	PS2DDR &= ~(1 << PS2DATA); // Data is an input signal
-	PS2PORT &= ~(1 << PS2CLOCK); // Set Clock low
-	PS2DDR |= (1 << PS2CLOCK); // CLK low
+	//hold the clock low and inform the KBD of the Parity error and request a resend.
+	//A command waiting for the idle bus is sent afterwards.
 	g_requestResend = 1;
-#endif
+	g_txTries = PS2TX_TRIES;
+	ps2TxInhibit(0xFE);
 }
 
-ISR(PS2INTVECT)
+#ifdef PS2_TIMING_STATS
+/* Optional instrumentation of the PS/2 clock, enable with
+   CDEFS = -DPS2_TIMING_STATS in the Makefile.
+   Timer1 runs with 4us per tick and restarts every 1ms, so all times are
+   measured in 4us ticks. After PS2TIMING_FRAMES received frames the interrupt
+   stops collecting until the main loop has printed the results.
+*/
+#define PS2TIMING_FRAMES 1000
+#define PS2TIMING_BUCKETS 8
+//must match OCR1A + 1 set in main.c
+#define PS2TIMING_TICKSPERMS 251
+//bit periods: <64us, 64-71us, 72-79us ... 104-111us, >= 112us
+#define PS2TIMING_PERIODMIN (64 / 4)
+#define PS2TIMING_PERIODSTEP (8 / 4)
+
+typedef struct {
+	uint16_t period[PS2TIMING_BUCKETS]; //histogram of the bit periods
+	uint16_t jitter[PS2TIMING_BUCKETS]; //change of the bit period to the previous bit, 4us steps
+	uint16_t frames;
+	uint8_t isrMax; //longest clock interrupt, ticks
+	uint8_t parityErrors;
+	uint8_t framingErrors;
+} ps2timing_t;
+
+ps2timing_t g_timing; //only modified by the interrupt while g_timingReady is false
+volatile bool g_timingReady;
+uint8_t g_timingLast; //time of the previous clock edge
+uint8_t g_timingPeriod; //previous bit period of the current frame, 0 = none
+uint8_t g_timingParity; //error counters at the start of the window
+uint8_t g_timingFraming;
+
+static uint8_t ps2TimingNow(void)
+{
+	return TCNT1; //never larger than 250
+}
+
+static uint8_t ps2TimingDiff(uint8_t start, uint8_t end)
+{
+	uint8_t diff = end - start;
+	if (end < start)
+	{
+		diff += PS2TIMING_TICKSPERMS;
+	}
+	return diff;
+}
+
+//called on entry of the clock interrupt, returns the timestamp
+static uint8_t ps2TimingEdge(void)
+{
+	uint8_t now = ps2TimingNow();
+	if ((sr == RX) && (rcv_bitcount) && (!g_resync) && (!g_timingReady))
+	{
+		uint8_t period = ps2TimingDiff(g_timingLast, now);
+		uint8_t idx = 0;
+		if (period >= PS2TIMING_PERIODMIN)
+		{
+			idx = (period - PS2TIMING_PERIODMIN) / PS2TIMING_PERIODSTEP + 1;
+			if (idx >= PS2TIMING_BUCKETS)
+			{
+				idx = PS2TIMING_BUCKETS - 1;
+			}
+		}
+		g_timing.period[idx]++;
+		if (g_timingPeriod)
+		{
+			uint8_t change = (period > g_timingPeriod) ? period - g_timingPeriod : g_timingPeriod - period;
+			if (change >= PS2TIMING_BUCKETS)
+			{
+				change = PS2TIMING_BUCKETS - 1;
+			}
+			g_timing.jitter[change]++;
+		}
+		g_timingPeriod = period;
+	}
+	else
+	{
+		g_timingPeriod = 0;
+	}
+	g_timingLast = now;
+	return now;
+}
+
+//called on exit of the clock interrupt
+static void ps2TimingIsrEnd(uint8_t entry)
+{
+	uint8_t duration = ps2TimingDiff(entry, ps2TimingNow());
+	if ((!g_timingReady) && (duration > g_timing.isrMax))
+	{
+		g_timing.isrMax = duration;
+	}
+}
+
+//called for every received frame, before checking it
+static void ps2TimingFrame(void)
+{
+	if (g_timingReady)
+	{
+		return;
+	}
+	g_timing.frames++;
+	if (g_timing.frames == PS2TIMING_FRAMES)
+	{
+		g_timing.parityErrors = parity_errors - g_timingParity;
+		g_timing.framingErrors = framing_errors - g_timingFraming;
+		g_timingReady = true;
+	}
+}
+
+static void ps2TimingPrint(void)
+{
+	uint8_t i;
+	printf_P(PSTR("PS/2 timing, %u frames: parity errors %u, framing errors %u, longest interrupt %uus\r\n"),
+	         g_timing.frames, g_timing.parityErrors, g_timing.framingErrors, g_timing.isrMax * 4);
+	printf_P(PSTR("Bit period, <64us, 8us steps, >=112us:"));
+	for (i = 0; i < PS2TIMING_BUCKETS; i++)
+	{
+		printf_P(PSTR(" %u"), g_timing.period[i]);
+	}
+	printf_P(PSTR("\r\nPeriod change, 4us steps, >=28us:"));
+	for (i = 0; i < PS2TIMING_BUCKETS; i++)
+	{
+		printf_P(PSTR(" %u"), g_timing.jitter[i]);
+	}
+	printf_P(PSTR("\r\n"));
+	//the interrupt does not touch the data until g_timingReady is cleared
+	memset(&g_timing, 0, sizeof(g_timing));
+	g_timingParity = parity_errors;
+	g_timingFraming = framing_errors;
+	g_timingReady = false;
+}
+#endif
+
+static void ps2ClockEdge(void)
 {
   if (sr == TX) { //Send bytes to device.
     if (send_bitcount <=7) // Data Byte
@@ -305,13 +806,36 @@ ISR(PS2INTVECT)
       sr = RX;
       PS2DDR &= ~(1 << PS2CLOCK | 1 << PS2DATA); // Clock and Data set back to input
       rcv_bitcount = 0;
-      g_NextByteIsAct = 1;
+      ps2TxSent();
     }
   }
 
   else { // Receive from device
   uint8_t result = 0;
 
+    if (g_txState == TXWAITIDLE)
+    {
+      TCNT2 = 0; //the keyboard is not idle, restart waiting
+    }
+    else if (g_txState == TXWAITACK)
+    {
+      g_txAnswered = true; //the keyboard is still there, even if the answer gets lost
+    }
+
+    if (g_resync)
+    {
+      TCNT0 = 0; //still within the broken frame
+      return;
+    }
+    if (rcv_bitcount == 0)
+    {
+      ps2IdleTimerStart(); //detects a missing clock edge of this frame
+    }
+    else
+    {
+      TCNT0 = 0;
+    }
+
     if (PS2PIN & (1 << PS2DATA))
     {
       result = 1;
@@ -338,16 +862,28 @@ ISR(PS2INTVECT)
     }
     else if (rcv_bitcount == 10)
     {
+#ifdef PS2_TIMING_STATS
+      ps2TimingFrame();
+#endif
+      if (g_lostSequence)
+      {
+        ps2LostSequenceStart(); //the lost sequence may continue with the next frame
+      }
+      else
+      {
+        TCCR0 = 0; //the frame is complete
+      }
       ssp |= (result << 1); // Stop Bit
       if ((ssp & 0x2) != 0x02) // Check start and stop bits.
       {
-        framing_error(ssp);
+        framing_error();
+        return;
       }
       else if (calc_parity(rcv_byte) == (ssp >> 2))
       {
-        if (g_NextByteIsAct)
+        if (g_txState == TXWAITACK)
         {
-          g_rxAct = 2;
+          ps2TxRetry(false); //bad parity of the ACK
         }
         else
         {
@@ -356,25 +892,65 @@ ISR(PS2INTVECT)
       }
       else
       {
-        if (rcv_byte == 0xFA)
+        if (rcv_byte == 0xFA) //dont put act data into the common control flow
         {
-          g_rxAct = 1;
+          if (g_txState == TXWAITACK)
+          {
+            ps2TxNext();
+          }
         }
-        else
+        else if ((rcv_byte == 0xFE) && (g_txState == TXWAITACK))
+        {
+          ps2TxRetry(false); //the keyboard requests a resend of the command
+        }
+        else if ((rcv_byte == 0xFC) && (g_txState == TXWAITACK))
+        {
+          ps2TxDrop(true); //error, a resend would not help
+          ps2TxStart();
+        }
+        else if ((rcv_byte == 0xEE) && (g_txState == TXWAITACK))
+        {
+          ps2TxNext(); //answer to the echo command
+        }
+        else if ((rcv_byte == 0xAA) && (mode == KEY))
+        {
+          g_batReceived = true; //never a scancode, a keyboard has been plugged in
+          ps2DecodeReset();
+        }
+        else if (mode == COMMAND)
         {
           ps2RxPut(rcv_byte);
         }
+        else if (g_codeSetQuery)
+        {
+          g_codeSetQuery = false;
+          g_codeSetReply = rcv_byte;
+        }
+        else
+        {
+          ps2DecodeByte(g_codeSet, rcv_byte);
+        }
       }
       rcv_bitcount = 0;
       rcv_byte = 0;
       result = 0;
-      g_NextByteIsAct = 0;
     }
 
   }
 
 }
 
+ISR(PS2INTVECT)
+{
+#ifdef PS2_TIMING_STATS
+	uint8_t entry = ps2TimingEdge();
+#endif
+	ps2ClockEdge();
+#ifdef PS2_TIMING_STATS
+	ps2TimingIsrEnd(entry);
+#endif
+}
+
 void ps2ReadInit(void)
 {
 #if (PS2INTENABLE == INT0)
@@ -387,7 +963,10 @@ void ps2ReadInit(void)
   SFIOR |= (1 << PUD); // force disable pullups
   PS2DDR &= ~(1 << PS2CLOCK | 1 << PS2DATA); // PINB6 = PS/2 Clock, PINB5 = PS/2 Data both set as input
   GICR |= (1 << PS2INTENABLE); // Enable Interrupt on PINB2 aka INT0
-  resetKbd();
+  ps2TimerStop();
+  ps2ResyncStop();
+  TIMSK |= (1 << OCIE2) | (1 << OCIE0); // Timer0 and 2 stay enabled, the timers are stopped by removing their clock
+  g_kbdState = KBDRESET; //done by the main loop
 }
 
 /*Usually the host feeds back the LED states, making sure they are in sync
@@ -396,219 +975,177 @@ void ps2ReadInit(void)
 */
 //#define LOCAL_LED_CONTROL
 
-bool ps2ReadPoll(uint8_t * modifierState, uint32_t * keycode, uint8_t * event)
+bool ps2ReadStatus(uint32_t timestamp)
 {
-	static uint16_t kb_register = 0;
-#ifdef LOCAL_LED_CONTROL
-	static uint8_t kb_leds = 0;
-#endif
+	static uint8_t txFailedReported = 0;
+	static uint8_t txRefusedReported = 0;
+	static uint8_t rxDroppedReported = 0;
+	static uint8_t highWaterReported = 0;
 	bool overflow = false;
 
-	if (g_requestResend)
+	bool failed = false;
+	uint8_t txFailed = g_txFailed;
+	if (txFailed != txFailedReported)
 	{
-		printf_P(PSTR("Resend due parity error\r\n"));
-		g_requestResend = 0;
-		sendps2(0xFE);
+		printf_P(PSTR("PS/2: Error, command failed, no answer (%u)\r\n"), txFailed);
+		txFailedReported = txFailed;
+		failed = true;
+	}
+	uint8_t txRefused = g_txRefused;
+	if (txRefused != txRefusedReported)
+	{
+		//the keyboard is still there, it just does not support the command
+		cli();
+		uint8_t cmd = g_txRefusedCmd[0];
+		uint8_t arg = g_txRefusedCmd[1];
+		sei();
+		printf_P(PSTR("PS/2: Warning, command 0x%x 0x%x refused (%u)\r\n"), cmd, arg, txRefused);
+		txRefusedReported = txRefused;
+		if ((cmd == 0xF0) && (arg != 0) && (g_codeSetWanted != 2))
+		{
+			//the keyboard stays in set 2 of its reset
+			printf_P(PSTR("PS/2: Code set %u refused, using set 2\r\n"), arg);
+			g_codeSetWanted = 2;
+			cli();
+			g_codeSet = 2;
+			ps2DecodeReset();
+			sei();
+		}
 	}
+	if (ps2KbdProcess(timestamp, failed))
+	{
+		overflow = true; //release the keys of the old keyboard
+	}
+	uint8_t rxDropped = g_rxDropped;
+	if (rxDropped != rxDroppedReported)
+	{
+		printf_P(PSTR("PS/2: Warning, responses dropped (%u)\r\n"), rxDropped);
+		rxDroppedReported = rxDropped;
+	}
+	uint8_t highWater = g_eventsHighWater;
+	if (highWater > highWaterReported)
+	{
+		printf_P(PSTR("PS/2: Event queue high water %u/%u\r\n"), highWater, EVENTENTRIES);
+		highWaterReported = highWater;
+	}
+	uint8_t codeSet = g_codeSetReply;
+	if (codeSet)
+	{
+		g_codeSetReply = 0;
+		if ((g_codeSetWanted == 3) && (codeSet != 3))
+		{
+			printf_P(PSTR("PS/2: Code set 3 not supported (%u), using set 2\r\n"), codeSet);
+			g_codeSetWanted = 2;
+			ps2CmdQueue(0xF0, 0x02, 2, false);
+		}
+		else if (codeSet == 3)
+		{
+			printf_P(PSTR("PS/2: Using code set 3\r\n"));
+			ps2SetTypematic(g_typematic); //set 3 has its own command for the repeats
+		}
+		else
+		{
+			printf_P(PSTR("PS/2: Using code set %u\r\n"), codeSet);
+		}
+	}
+#ifdef PS2_TIMING_STATS
+	if (g_timingReady)
+	{
+		ps2TimingPrint();
+	}
+#endif
 	if (g_rxOverflow)
 	{
-		printf_P(PSTR("Warning, PS/2 buffer overflow\r\n"));
+		printf_P(PSTR("Warning, PS/2 key events lost (%u dropped, %u broken frames)\r\n"), g_eventsDropped, framing_errors);
 		g_rxOverflow = 0;
 		overflow = 1;
 	}
-  uint8_t scancode = ps2RxGet();
-  if (scancode)
-  {
-      //printf("Scancode: %x, mode %x reg %x, perr: %u\r\n", scancode, mode, kb_register, parity_errors);
-      if (mode == EXTKEY2) {
-        if (kb_register & (1 << KB_KUP)) //This is a keyup event
-        {
-          //E1 F0 14 F0 77
-          if (scancode == 0x77) {
-            *event = 2;
-            *modifierState = kb_register;
-            *keycode = 0xE11477;
-            mode = KEY;
-            kb_register &= ~(1 << KB_KUP);
-          } else if ((scancode != 0x14) && (scancode != 0xF0)) {
-            kb_register &= ~(1 << KB_KUP);
-            mode = KEY;
-          }
-        }
-        else
-        {
-          //E1 14 77
-          if (scancode == 0x77) {
-            *event = 1;
-            *modifierState = kb_register;
-            *keycode = 0xE11477;
-            mode = KEY;
-          }
-          else if (scancode == 0xF0) {
-            kb_register |= (1 << KB_KUP);
-          }
-          else if (scancode != 0x14) {
-            mode = KEY;
-          }
-        }
-      }
-      else if (mode == EXTKEY) {
-        if (kb_register & (1 << KB_KUP)) //This is a keyup event
-        {
-          switch(scancode)
-          {
-            case 0x14:
-              kb_register &= ~(1 << KB_R_CTRL);
-              break;
-            case 0x11:
-              kb_register &= ~(1 << KB_R_ALT);
-              break;
-            case 0x1F: //left GUI
-              kb_register &= ~(1 << KB_L_GUI);
-              mode = KEY;
-              break;
-            case 0x27: //right GUI
-              kb_register &= ~(1 << KB_R_GUI);
-              mode = KEY;
-              break;
-            default:
-              *keycode = (0xE0U << 8U) | scancode;
-              break;
-          }
-          kb_register &= ~(1 << KB_KUP);
-          mode = KEY;
-          *event = 2;
-          *modifierState = kb_register;
-        }
-        else {
-          switch(scancode)
-          {
-            case 0xF0: //Key up
-              kb_register |= (1 << KB_KUP);
-              mode = EXTKEY;
-              break;
-            case 0x14: //ctrl
-              kb_register |= (1 << KB_R_CTRL);
-              mode = KEY;
-              break;
-            case 0x11: //alt
-              kb_register |= (1 << KB_R_ALT);
-              mode = KEY;
-              break;
-            case 0x1F: //left GUI
-              kb_register |= (1 << KB_L_GUI);
-              mode = KEY;
-              break;
-            case 0x27: //right GUI
-              kb_register |= (1 << KB_R_GUI);
-              mode = KEY;
-              break;
-            default:
-              mode = KEY;
-              *keycode = (0xE0U << 8) | scancode;
-              break;
-          }
-          if (scancode != 0xF0)
-          {
-            *event = 1;
-            *modifierState = kb_register;
-          }
-        }
-      }
-      else if (mode == KEY)
-      {
-        if (kb_register & (1 << KB_KUP)) //This is a keyup event
-        {
-          switch(scancode)
-          {
-            case 0x12: // Left Shift
-              kb_register &= ~(1 << KB_L_SHIFT);
-              break;
-            case 0x59: // Right Shift
-              kb_register &= ~(1 << KB_R_SHIFT);
-              break;
-            case 0x14:
-              kb_register &= ~(1 << KB_L_CTRL);
-              break;
-            case 0x11:
-              kb_register &= ~(1 << KB_L_ALT);
-              break;
-            default:
-              //printf("Up normal\r\n");
-              *keycode = scancode;
-              break;
-          }
-          kb_register &= ~(1 << KB_KUP);
-          mode = KEY;
-          *event = 2; //key up
-          *modifierState = kb_register;
-        }
-        else {
-          switch(scancode)
-          {
-            case 0xF0: //Key up
-              kb_register |= (1 << KB_KUP);
-              //printf("Key up next\r\n");
-              break;
-            case 0xE0: //Extended key sequence
-              mode = EXTKEY;
-              break;
-            case 0xE1: //Extended key sequence for pause
-              mode = EXTKEY2;
-              break;
-            case 0x12: // Left Shift
-              kb_register |= (1 << KB_L_SHIFT);
-              break;
-            case 0x59: // Right Shift
-              kb_register |= (1 << KB_R_SHIFT);
-              break;
-            case 0x14: //ctrl
-              kb_register |= (1 << KB_L_CTRL);
-              break;
-            case 0x11: //alt
-              kb_register |= (1 << KB_L_ALT);
-              break;
-            case 0x58: //capslock
-#ifdef LOCAL_LED_CONTROL
-              kb_leds ^= (1 << KB_CAPSLK);
-              sendps2(0xed);
-              sendps2(kb_leds & 0x07); // Set KBD Lights
-#endif
-              *keycode = scancode;
-              break;
-            case 0x77: //numlock
+	return overflow;
+}
+
+bool ps2ReadPoll(ps2event_t * event)
+{
 #ifdef LOCAL_LED_CONTROL
-              kb_leds ^= (1 << KB_NUMLK);
-              sendps2(0xed);
-              sendps2(kb_leds & 0x07); // Set KBD Lights
+	static uint8_t kb_leds = 0;
 #endif
-              *keycode = scancode;
-              break;
-            case 0x7E: //scrllock
+	if (!ps2EventGet(event))
+	{
+		return false;
+	}
 #ifdef LOCAL_LED_CONTROL
-              kb_leds ^= (1 << KB_SCRLK);
-              sendps2(0xed);
-              sendps2(kb_leds & 0x07); // Set KBD Lights
+	if (event->type == PS2EVENT_PRESS)
+	{
+		uint8_t ledsOld = kb_leds;
+		switch (event->key)
+		{
+			case 0x58: kb_leds ^= (1 << KB_CAPSLK); break; //capslock
+			case 0x77: kb_leds ^= (1 << KB_NUMLK); break; //numlock
+			case 0x7E: kb_leds ^= (1 << KB_SCRLK); break; //scrllock
+			default: break;
+		}
+		if (kb_leds != ledsOld)
+		{
+			ps2SetLeds(kb_leds & 0x07); // Set KBD Lights
+		}
+	}
 #endif
-             *keycode = scancode;
-              break;
-            default: // Fall through for all normal usb codes
-              *keycode = scancode;
-              break;
-          }
-          if ((scancode != 0xF0) && (scancode != 0xE0) && (scancode != 0xE1))
-          {
-            *event = 1; //key down
-            *modifierState = kb_register;
-          }
-        }
-      }
-    }
-	return overflow;
+	return true;
+}
+
+bool ps2Idle(void)
+{
+	if ((g_kbdState != KBDREADY) && (g_kbdState != KBDLOST))
+	{
+		return false; //waiting for the reset, needs the timestamp
+	}
+	return (sr == RX) && (rcv_bitcount == 0) && (!g_resync) && (!g_lostSequence) && (g_txState == TXIDLE) &&
+	       (g_txQueueRead == g_txQueueWrite) && (g_rxbufferRead == g_rxbufferWrite) &&
+	       (!g_batReceived) && (!ps2EventAvailable());
+}
+
+void ps2KbdRecheck(void)
+{
+	if (g_kbdState == KBDLOST)
+	{
+		g_kbdState = KBDRESET;
+	}
+}
+
+void ps2SetCodeSet(uint8_t set)
+{
+	g_codeSetSelected = set;
+	g_codeSetWanted = set;
+	ps2CmdQueue(0xF0, set, 2, false);
+	ps2CmdQueue(0xF0, 0x00, 2, false); //query, checks if the keyboard supports the set
+}
+
+void ps2SetTypematic(uint8_t typematic)
+{
+	g_typematic = typematic;
+	if (typematic == PS2_TYPEMATIC_OFF)
+	{
+		if (g_codeSet == 3)
+		{
+			ps2CmdQueue(0xF8, 0, 1, false); //all keys make/break, no repeats
+		}
+		else
+		{
+			//set 2 can not turn the repeats off, use the slowest ones
+			ps2CmdQueue(0xF3, PS2_TYPEMATIC(3, 0x1F), 2, true);
+		}
+	}
+	else
+	{
+		if (g_codeSet == 3)
+		{
+			ps2CmdQueue(0xFA, 0, 1, false); //all keys make/break and typematic
+		}
+		ps2CmdQueue(0xF3, typematic, 2, true);
+	}
 }
 
 void ps2SetLeds(uint8_t ledBits) {
-	sendps2(0xed);
-	sendps2(ledBits);
+	g_leds = ledBits;
+	ps2CmdQueue(0xED, ledBits, 2, true);
 }
 
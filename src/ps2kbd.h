@@ -19,6 +19,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "ps2decode.h"
 
 #if 0
 //original
@@ -51,11 +54,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define KB_CAPSLK 2
 
 enum ps2state {
-    KEY,
-    EXTKEY,
-    EXTKEY2,
-    PAUSE,
-    COMMAND,
+    KEY, //bytes are decoded to key events
+    COMMAND, //bytes are responses to a command
 };
 
 enum bufstate {
@@ -68,8 +68,68 @@ enum rxtxstate {
     RX
 };
 
+enum ps2kbdstate {
+    KBDRESET, //reset command is to be sent
+    KBDWAITBAT, //waiting for the self test result of the keyboard
+    KBDREADY,
+    KBDLOST //no keyboard, waiting before the next reset
+};
+
+enum ps2txstate {
+    TXIDLE,
+    TXWAITIDLE, //waiting for 1ms without a clock from the keyboard
+    TXINHIBIT, //clock hold low by the host
+    TXREQUEST, //data low too, the clock is released after one timer tick
+    TXSENDING, //the keyboard clocks in the byte
+    TXWAITACK
+};
+
+//code set requested after a keyboard reset, 2 or 3. Set 3 falls back to set 2.
+#ifndef PS2_CODESET
+#define PS2_CODESET 3
+#endif
+
+/*Typematic value of the F3 command.
+  delay: 0..3 -> 250ms..1000ms, rate: 0x00..0x1F -> 30..2 repeats per second
+  The host generates its own repeats, so they are off by default.
+*/
+#define PS2_TYPEMATIC(delay, rate) ((((delay) & 0x03) << 5) | ((rate) & 0x1F))
+#define PS2_TYPEMATIC_OFF 0xFF
+#ifndef PS2_TYPEMATIC_DEFAULT
+#define PS2_TYPEMATIC_DEFAULT PS2_TYPEMATIC_OFF
+#endif
+
 void ps2ReadInit(void);
 
-bool ps2ReadPoll(uint8_t * modifierState, uint32_t * keycode, uint8_t * event);
+/*Reports errors and (re)initializes the keyboard, call from the main loop.
+  timestamp: in ms
+  Returns true if key events have been lost or the keyboard was removed.
+*/
+bool ps2ReadStatus(uint32_t timestamp);
+
+//returns true if there was a key event, call until false to get all pending events
+bool ps2ReadPoll(ps2event_t * event);
 
+//returns at once, the command is sent by the interrupts
 void ps2SetLeds(uint8_t ledBits);
+
+/*Returns true if nothing is received, sent or waiting for the main loop, so
+  the timers may stop. Call with interrupts disabled to sleep afterwards.
+*/
+bool ps2Idle(void);
+
+/*Call after the ms timestamp paused, e.g. by a power down. A lost keyboard
+  is reset at once instead of after the rest of its backoff.
+*/
+void ps2KbdRecheck(void);
+
+/*Switches the keyboard to code set 2 or 3, returns at once.
+  The result is reported by ps2ReadStatus().
+*/
+void ps2SetCodeSet(uint8_t set);
+
+/*Sets the typematic delay and rate (PS2_TYPEMATIC) or PS2_TYPEMATIC_OFF,
+  returns at once. Code set 2 can not turn the repeats off, the slowest
+  repeats are used then.
+*/
+void ps2SetTypematic(uint8_t typematic);
@@ -0,0 +1,342 @@
+/*
+Host test of the scancode decoder and the report builder, run by
+"make host-test". Replays the scancode corpus, compares the resulting
+reports with the golden file and then measures the decoded key events per
+second on the build host.
+
+Usage: hosttest [-w] corpus golden
+-w writes the golden file instead, only after an intended change of the keymap.
+
+Corpus format, one line per key action:
+  hex bytes as sent by the keyboard, "set 2" or "set 3" selects the code set
+  and # starts a comment.
+Golden format, one line for each changed report:
+  corpus line, report (K keyboard, B boot, C consumer, S system), bytes
+
+Copyright (C) 2020-2021 Malte Marwedel
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ps2decode.h"
+#include "keyreport.h"
+
+#define CORPUSMAX 8192
+#define BENCHMARK_NS 1000000000ULL
+
+typedef struct {
+	uint8_t codeSet;
+	uint8_t scancode;
+	uint16_t line; //within the corpus file
+} corpusByte_t;
+
+static corpusByte_t g_corpus[CORPUSMAX];
+static unsigned int g_corpusLen;
+
+//state of the main loop
+static uint8_t g_keysPressed[KEYBITMAPBYTES];
+static uint8_t g_modifiers;
+
+//newest report of each kind, only changes are written
+static uint8_t g_lastNkro[USBNKROBYTES];
+static uint8_t g_lastBoot[USBBOOTBYTES];
+static uint8_t g_lastBootLen;
+static uint16_t g_lastConsumer;
+static uint8_t g_lastSystem;
+
+//the firmware uses some keys for the macros and the LEDs, not done here
+bool UsbAlternateHook(uint8_t * usbCode, uint8_t * modifiers)
+{
+	(void)usbCode;
+	(void)modifiers;
+	return false;
+}
+
+static bool corpusLoad(const char * filename)
+{
+	FILE * f = fopen(filename, "r");
+	if (!f)
+	{
+		perror(filename);
+		return false;
+	}
+	char text[256];
+	uint16_t line = 0;
+	uint8_t codeSet = 2;
+	while (fgets(text, sizeof(text), f))
+	{
+		line++;
+		char * comment = strchr(text, '#');
+		if (comment)
+		{
+			*comment = '\0';
+		}
+		char * token = strtok(text, " \t\r\n");
+		if ((token) && (strcmp(token, "set") == 0))
+		{
+			token = strtok(NULL, " \t\r\n");
+			codeSet = (token) ? atoi(token) : 0;
+			if ((codeSet != 2) && (codeSet != 3))
+			{
+				fprintf(stderr, "%s:%u: code set 2 or 3 expected\n", filename, line);
+				fclose(f);
+				return false;
+			}
+			continue;
+		}
+		while (token)
+		{
+			char * end;
+			unsigned long value = strtoul(token, &end, 16);
+			if ((*end) || (value > 0xFF) || (g_corpusLen == CORPUSMAX))
+			{
+				fprintf(stderr, "%s:%u: invalid byte %s\n", filename, line, token);
+				fclose(f);
+				return false;
+			}
+			g_corpus[g_corpusLen].codeSet = codeSet;
+			g_corpus[g_corpusLen].scancode = value;
+			g_corpus[g_corpusLen].line = line;
+			g_corpusLen++;
+			token = strtok(NULL, " \t\r\n");
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+static void reportPrint(FILE * out, uint16_t line, char kind, const uint8_t * data, uint8_t len)
+{
+	fprintf(out, "%u %c", line, kind);
+	for (uint8_t i = 0; i < len; i++)
+	{
+		fprintf(out, " %02x", data[i]);
+	}
+	fprintf(out, "\n");
+}
+
+//like UpdateUsbKeystate of main.c, but for both protocols at once. out may be NULL
+static void reportsUpdate(FILE * out, uint16_t line)
+{
+	uint8_t usages[USBNKROUSAGES / 8];
+	uint16_t consumer;
+	uint8_t system;
+	uint8_t modifiers = g_modifiers;
+	keyReportBuild(g_keysPressed, &modifiers, usages, &consumer, &system);
+	uint8_t nkro[USBNKROBYTES];
+	keyReportNkro(modifiers, usages, nkro);
+	if (memcmp(nkro, g_lastNkro, USBNKROBYTES) != 0)
+	{
+		memcpy(g_lastNkro, nkro, USBNKROBYTES);
+		if (out)
+		{
+			reportPrint(out, line, 'K', nkro, USBNKROBYTES);
+		}
+	}
+	uint8_t boot[USBBOOTBYTES];
+	uint8_t bootLen = keyReportBoot(modifiers, usages, boot);
+	if ((bootLen != g_lastBootLen) || (memcmp(boot, g_lastBoot, bootLen) != 0))
+	{
+		memcpy(g_lastBoot, boot, bootLen);
+		g_lastBootLen = bootLen;
+		if (out)
+		{
+			reportPrint(out, line, 'B', boot, bootLen);
+		}
+	}
+	if (consumer != g_lastConsumer)
+	{
+		g_lastConsumer = consumer;
+		uint8_t report[USBCONSUMERBYTES] = {REPORTID_CONSUMER, consumer & 0xFF, consumer >> 8};
+		if (out)
+		{
+			reportPrint(out, line, 'C', report, USBCONSUMERBYTES);
+		}
+	}
+	if (system != g_lastSystem)
+	{
+		g_lastSystem = system;
+		uint8_t report[USBSYSTEMBYTES] = {REPORTID_SYSTEM, system};
+		if (out)
+		{
+			reportPrint(out, line, 'S', report, USBSYSTEMBYTES);
+		}
+	}
+}
+
+//returns the number of key events
+static unsigned long corpusReplay(FILE * out)
+{
+	unsigned long events = 0;
+	ps2event_t event;
+	memset(g_keysPressed, 0, sizeof(g_keysPressed));
+	g_modifiers = 0;
+	memset(g_lastNkro, 0, sizeof(g_lastNkro));
+	g_lastNkro[0] = REPORTID_KEYBOARD;
+	memset(g_lastBoot, 0, sizeof(g_lastBoot));
+	g_lastBootLen = 2;
+	g_lastConsumer = 0;
+	g_lastSystem = 0;
+	ps2DecodeReset();
+	while (ps2EventGet(&event));
+	g_rxOverflow = 0;
+	for (unsigned int i = 0; i < g_corpusLen; i++)
+	{
+		ps2DecodeByte(g_corpus[i].codeSet, g_corpus[i].scancode);
+		if (g_rxOverflow)
+		{
+			//as done by the main loop
+			g_rxOverflow = 0;
+			while (ps2EventGet(&event));
+			memset(g_keysPressed, 0, sizeof(g_keysPressed));
+			g_modifiers = 0;
+			reportsUpdate(out, g_corpus[i].line);
+		}
+		while (ps2EventGet(&event))
+		{
+			events++;
+			if (keyEventApply(g_keysPressed, &g_modifiers, &event, true))
+			{
+				reportsUpdate(out, g_corpus[i].line);
+			}
+		}
+	}
+	return events;
+}
+
+static char * fileRead(const char * filename)
+{
+	FILE * f = fopen(filename, "r");
+	if (!f)
+	{
+		perror(filename);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char * text = malloc(len + 1);
+	if ((!text) || (fread(text, 1, len, f) != (size_t)len))
+	{
+		fprintf(stderr, "%s: read failed\n", filename);
+		free(text);
+		fclose(f);
+		return NULL;
+	}
+	text[len] = '\0';
+	fclose(f);
+	return text;
+}
+
+//prints the first differing line, returns true if equal
+static bool goldenCompare(const char * filename, const char * result)
+{
+	char * golden = fileRead(filename);
+	if (!golden)
+	{
+		return false;
+	}
+	const char * a = golden;
+	const char * b = result;
+	unsigned int line = 1;
+	while ((*a) && (*a == *b))
+	{
+		if (*a == '\n')
+		{
+			line++;
+		}
+		a++;
+		b++;
+	}
+	bool equal = (*a == *b);
+	if (!equal)
+	{
+		//back to the start of the line
+		while ((a > golden) && (a[-1] != '\n'))
+		{
+			a--;
+			b--;
+		}
+		fprintf(stderr, "%s:%u: differs\n  expected: %.*s\n  got:      %.*s\n", filename, line,
+		        (int)strcspn(a, "\n"), a, (int)strcspn(b, "\n"), b);
+	}
+	free(golden);
+	return equal;
+}
+
+static uint64_t timeNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char ** argv)
+{
+	bool write = false;
+	if ((argc > 1) && (strcmp(argv[1], "-w") == 0))
+	{
+		write = true;
+		argc--;
+		argv++;
+	}
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: hosttest [-w] corpus golden\n");
+		return 2;
+	}
+	if (!corpusLoad(argv[1]))
+	{
+		return 2;
+	}
+	char * result;
+	size_t resultLen;
+	FILE * out = open_memstream(&result, &resultLen);
+	unsigned long events = corpusReplay(out);
+	fclose(out);
+	if (write)
+	{
+		FILE * f = fopen(argv[2], "w");
+		if ((!f) || (fputs(result, f) < 0) || (fclose(f) != 0))
+		{
+			perror(argv[2]);
+			return 2;
+		}
+		printf("%s written\n", argv[2]);
+	}
+	else if (!goldenCompare(argv[2], result))
+	{
+		return 1;
+	}
+	free(result);
+	//the decoder and report builder only, the ISR and USB are not part of it
+	unsigned long total = 0;
+	uint64_t start = timeNs();
+	uint64_t elapsed;
+	do
+	{
+		total += corpusReplay(NULL);
+		elapsed = timeNs() - start;
+	} while (elapsed < BENCHMARK_NS);
+	printf("%u bytes, %lu key events: reports match\n", g_corpusLen, events);
+	printf("%.0f key events/s on the build host\n", total * 1e9 / elapsed);
+	return 0;
+}
@@ -0,0 +1,287 @@
+/*
+Fault injection test of the PS/2 receiver, run by "make host-test".
+The clock interrupt and the timer interrupts of ps2kbd.c are called like
+the hardware would, with broken frames in between. After every broken
+frame the receiver must be in sync again with the next frame, there must be
+no phantom key and no stuck key.
+
+The keyboard leaves the clock idle for longer than PS2RESYNC_TICKS between
+two frames, as the keyboards seen so far do (>= 0.5ms). Frames sent one after
+the other are within PS2SEQUENCE_TICKS, keyPause() waits longer.
+
+Copyright (C) 2020-2021 Malte Marwedel
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "ps2kbd.h"
+
+volatile uint8_t DDRB, PINB, PORTB;
+volatile uint8_t GICR, GIFR, MCUCR, MCUCSR, SFIOR, SREG;
+volatile uint8_t TCCR0, TCNT0, OCR0, TCCR2, TCNT2, OCR2, TIFR, TIMSK;
+
+//interrupts of ps2kbd.c
+void INT2_vect(void);
+void TIMER0_COMP_vect(void);
+void TIMER2_COMP_vect(void);
+
+extern volatile uint8_t parity_errors;
+extern volatile uint8_t framing_errors;
+extern volatile enum rxtxstate sr;
+
+#define FRAME_OK 0
+#define FRAME_BADPARITY 1
+#define FRAME_BADSTOP 2
+
+#define NOSKIP -1
+
+//state of the main loop
+static uint8_t g_pressed[256 / 8];
+static unsigned int g_lost; //g_rxOverflow seen
+
+static uint8_t g_kbdLast; //repeated on a resend request
+static uint8_t g_kbdReceived; //last byte sent by the host
+
+static unsigned int g_failed;
+
+//like the main loop, which is fast compared to a frame
+static void mainLoop(void)
+{
+	ps2event_t event;
+	if (g_rxOverflow)
+	{
+		g_rxOverflow = 0;
+		memset(g_pressed, 0, sizeof(g_pressed));
+		g_lost++;
+	}
+	while (ps2EventGet(&event))
+	{
+		if (event.type == PS2EVENT_PRESS)
+		{
+			g_pressed[event.key / 8] |= 1 << (event.key & 7);
+		}
+		else
+		{
+			g_pressed[event.key / 8] &= ~(1 << (event.key & 7));
+		}
+	}
+}
+
+static void clockEdge(uint8_t data)
+{
+	if (data)
+	{
+		PINB |= (1 << PB1);
+	}
+	else
+	{
+		PINB &= ~(1 << PB1);
+	}
+	INT2_vect();
+}
+
+//the clock stays idle, Timer0 fires if it has been started
+static void busIdle(void)
+{
+	if (TCCR0)
+	{
+		TIMER0_COMP_vect();
+	}
+}
+
+//no frame for longer than a scancode sequence takes, Timer0 fires until it stops
+static void keyPause(void)
+{
+	while (TCCR0)
+	{
+		TIMER0_COMP_vect();
+	}
+}
+
+//the keyboard clocks in a byte from the host, if the host inhibited the bus
+static bool kbdReceive(void)
+{
+	if (!TCCR2)
+	{
+		return false;
+	}
+	TIMER2_COMP_vect(); //end of the inhibit, the host pulls data low
+	TIMER2_COMP_vect(); //the host releases the clock
+	if (sr != TX)
+	{
+		return false;
+	}
+	uint8_t byte = 0;
+	for (uint8_t i = 0; i < 11; i++)
+	{
+		INT2_vect();
+		//the host drives the data line low by its direction register
+		if ((i < 8) && (!(DDRB & (1 << PB1))))
+		{
+			byte |= 1 << i;
+		}
+	}
+	g_kbdReceived = byte;
+	return true;
+}
+
+//skip: bit of the frame without a clock edge, 0 = start bit ... 10 = stop bit
+static void kbdSend(uint8_t byte, int8_t skip, uint8_t fault)
+{
+	uint8_t bits[11];
+	uint8_t ones = 0;
+	bits[0] = 0;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		bits[1 + i] = (byte >> i) & 1;
+		ones += bits[1 + i];
+	}
+	bits[9] = ((ones & 1) == 0) ^ (fault == FRAME_BADPARITY); //odd parity
+	bits[10] = (fault != FRAME_BADSTOP);
+	for (int8_t i = 0; i < 11; i++)
+	{
+		if (i != skip)
+		{
+			clockEdge(bits[i]);
+		}
+	}
+	g_kbdLast = byte;
+	busIdle();
+	mainLoop();
+	if ((kbdReceive()) && (g_kbdReceived == 0xFE))
+	{
+		kbdSend(g_kbdLast, NOSKIP, FRAME_OK);
+	}
+}
+
+static void kbdSendOk(const uint8_t * data, uint8_t len)
+{
+	for (uint8_t i = 0; i < len; i++)
+	{
+		kbdSend(data[i], NOSKIP, FRAME_OK);
+	}
+}
+
+static void stateReset(void)
+{
+	ps2event_t event;
+	ps2DecodeReset();
+	while (ps2EventGet(&event));
+	g_rxOverflow = 0;
+	memset(g_pressed, 0, sizeof(g_pressed));
+	g_lost = 0;
+	parity_errors = 0;
+	framing_errors = 0;
+	g_kbdReceived = 0;
+}
+
+static uint8_t keysCount(void)
+{
+	uint8_t num = 0;
+	for (uint16_t key = 0; key < 256; key++)
+	{
+		if (g_pressed[key / 8] & (1 << (key & 7)))
+		{
+			num++;
+		}
+	}
+	return num;
+}
+
+static bool keyPressed(uint8_t key)
+{
+	return (g_pressed[key / 8] & (1 << (key & 7))) != 0;
+}
+
+static void check(bool ok, const char * name, const char * what)
+{
+	if (!ok)
+	{
+		printf("%s: %s\n", name, what);
+		g_failed++;
+	}
+}
+
+/*A is held, the F0 of its release is broken. Afterwards no key may be held,
+  neither A nor the 1C as phantom press. The next key after the broken
+  release (the frame after 1C) must work again.
+*/
+static void releaseBroken(const char * name, int8_t skip, uint8_t fault)
+{
+	static const uint8_t pressA[] = {0x1C};
+	static const uint8_t typeS[] = {0x1B, 0xF0, 0x1B, 0x1B};
+	stateReset();
+	kbdSendOk(pressA, sizeof(pressA));
+	check(keyPressed(0x1C), name, "A not pressed");
+	kbdSend(0xF0, skip, fault);
+	kbdSend(0x1C, NOSKIP, FRAME_OK);
+	check(keysCount() == 0, name, "phantom or stuck key after the broken frame");
+	check(framing_errors == 1, name, "not exactly one frame lost");
+	kbdSendOk(typeS, sizeof(typeS));
+	check((keysCount() == 1) && (keyPressed(0x1B)), name, "no resync after the broken frame");
+	check(framing_errors == 1, name, "more frames lost");
+}
+
+int main(void)
+{
+	static const uint8_t pressA[] = {0x1C};
+	char name[64];
+	ps2ReadInit();
+	for (int8_t skip = 0; skip < 11; skip++)
+	{
+		snprintf(name, sizeof(name), "clock edge of bit %d dropped", skip);
+		releaseBroken(name, skip, FRAME_OK);
+	}
+	releaseBroken("bad stop bit", NOSKIP, FRAME_BADSTOP);
+
+	//a lost E0 of E0 75 (up) must not result in 75 (keypad 8)
+	static const uint8_t up[] = {0x75, 0xE0, 0xF0, 0x75, 0xE0, 0x75};
+	stateReset();
+	kbdSend(0xE0, 4, FRAME_OK);
+	kbdSendOk(up, sizeof(up));
+	check((keysCount() == 1) && (keyPressed(PS2_E0(0x75))), "E0 dropped", "phantom key or no resync");
+
+	//a key pressed after a pause is no part of the lost sequence and must be reported
+	static const uint8_t pressS[] = {0x1B};
+	stateReset();
+	kbdSendOk(pressA, sizeof(pressA));
+	kbdSend(0xF0, 4, FRAME_OK);
+	keyPause();
+	kbdSendOk(pressS, sizeof(pressS));
+	check((keysCount() == 1) && (keyPressed(0x1B)), "key after a pause", "press dropped");
+
+	//bad parity: the host requests a resend, nothing is lost
+	static const uint8_t releaseA[] = {0x1C};
+	stateReset();
+	kbdSendOk(pressA, sizeof(pressA));
+	kbdSend(0xF0, NOSKIP, FRAME_BADPARITY);
+	check(g_kbdReceived == 0xFE, "bad parity", "no resend requested");
+	kbdSendOk(releaseA, sizeof(releaseA));
+	check((keysCount() == 0) && (g_lost == 0) && (framing_errors == 0) && (parity_errors == 1),
+	      "bad parity", "release lost");
+
+	if (g_failed)
+	{
+		printf("%u fault injection checks failed\n", g_failed);
+		return 1;
+	}
+	printf("fault injection: every broken frame resynchronised within one frame, no phantom keys\n");
+	return 0;
+}
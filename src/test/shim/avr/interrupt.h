@@ -0,0 +1,16 @@
+#pragma once
+/*
+Replacement of <avr/interrupt.h> for the host test, an interrupt is an
+ordinary function called by the test.
+*/
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void); void vector(void)
+
+static inline void cli(void)
+{
+}
+
+static inline void sei(void)
+{
+}
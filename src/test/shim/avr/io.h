@@ -0,0 +1,35 @@
+#pragma once
+/*
+Replacement of <avr/io.h> for the host test, only the registers and bits
+used by ps2kbd.c. The registers are variables defined by the test.
+*/
+#include <stdint.h>
+
+extern volatile uint8_t DDRB, PINB, PORTB;
+extern volatile uint8_t GICR, GIFR, MCUCR, MCUCSR, SFIOR, SREG;
+extern volatile uint8_t TCCR0, TCNT0, OCR0, TCCR2, TCNT2, OCR2, TIFR, TIMSK;
+
+#define PB1 1
+#define PB2 2
+
+#define INT0 6
+#define INT1 7
+#define INT2 5
+#define INTF2 5
+#define ISC01 1
+#define ISC11 3
+#define ISC2 6
+#define PUD 2
+
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM01 3
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM21 3
+#define OCF0 1
+#define OCIE0 1
+#define OCF2 7
+#define OCIE2 7
@@ -0,0 +1,17 @@
+#pragma once
+/*
+Replacement of <avr/pgmspace.h> for the host test. The flash tables become
+ordinary constants and the debug prints are dropped.
+*/
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+static inline int printf_P(const char * format, ...)
+{
+	(void)format;
+	return 0;
+}
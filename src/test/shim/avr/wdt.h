@@ -0,0 +1,2 @@
+#pragma once
+//Replacement of <avr/wdt.h> for the host test
@@ -0,0 +1,12 @@
+#pragma once
+//Replacement of <util/delay.h> for the host test, the bus is simulated without timing
+
+static inline void _delay_us(double us)
+{
+	(void)us;
+}
+
+static inline void _delay_ms(double ms)
+{
+	(void)ms;
+}
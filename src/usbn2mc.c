@@ -17,6 +17,7 @@
 */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "usbn2mc.h"
 #include "uart.h"
 
@@ -40,57 +41,68 @@ void USBNInitMC(void)
 
 
 
-unsigned char USBNBurstRead(void)
+static inline void USBNAddress(unsigned char Adr)
 {
-  //unsigned char result;
-
-  USB_CTRL_PORT ^= (PF_CS | PF_RD);
-  asm("nop");              // pause for data to get to bus
-  asm("nop");
-  //result = USB_DATA_IN;
-  USB_CTRL_PORT ^= (PF_CS | PF_RD);
-  asm("nop");              // pause for data to get to bus
-  return USB_DATA_IN;
-  //return result;
+  USB_DATA_OUT = Adr;        // put the address on the bus
+  USB_DATA_DDR = 0xff;         // set for output
+  asm volatile("nop");     // pause for data to get to bus
+  USB_CTRL_PORT ^= (PF_CS | PF_WR | PF_A0);  // strobe the CS, WR, and A0 pins
+  asm volatile("nop");     // pause for data to get to bus
+  USB_CTRL_PORT ^= (PF_CS | PF_WR | PF_A0);
+  asm volatile("nop");     // pause for data to get to bus
 }
 
 unsigned char USBNRead(unsigned char Adr)
 {
-  USB_DATA_DDR = 0xff;        // set for output
-  USB_DATA_OUT = Adr;        // load address
-
-  USB_CTRL_PORT ^= (PF_CS | PF_WR | PF_A0);  // strobe the CS, WR, and A0 pins
-  asm("nop");              // pause for data to get to bus
-  USB_CTRL_PORT ^= (PF_CS | PF_WR | PF_A0);
-  asm("nop");              // pause for data to get to bus
+  USBNAddress(Adr);
   USB_DATA_DDR = 0x00;       // set PortD for input
-  asm("nop");              // pause for data to get to bus
+  asm volatile("nop");     // pause for data to get to bus
   return (USBNBurstRead());// get data off the bus
 }
 
+void USBNReadFifo(unsigned char Adr, unsigned char* data, unsigned char len)
+{
+  if (len == 0)
+    return;
+  USBNAddress(Adr);
+  USB_DATA_DDR = 0x00;       // set PortD for input
+  asm volatile("nop");     // pause for data to get to bus
+  do
+  {
+    *data++ = USBNBurstRead();
+  } while (--len);
+}
+
 
 
 // Write data to usbn96x register
 void USBNWrite(unsigned char Adr, unsigned char Data)
 {
-  USB_DATA_OUT = Adr;        // put the address on the bus
-  USB_DATA_DDR = 0xff;         // set for output
-  asm("nop");              // pause for data to get to bus
-  USB_CTRL_PORT ^= (PF_CS | PF_WR | PF_A0);
-  asm("nop");              // pause for data to get to bus
-  USB_CTRL_PORT ^= (PF_CS | PF_WR | PF_A0);
-  asm("nop");              // pause for data to get to bus
+  USBNAddress(Adr);
   USBNBurstWrite(Data);
 }
 
+// about 15 cycles per byte, a USBNWrite() for each byte needed about 45 (counted by hand)
+void USBNWriteFifo(unsigned char Adr, const unsigned char* data, unsigned char len)
+{
+  if (len == 0)
+    return;
+  USBNAddress(Adr);
+  do
+  {
+    USBNBurstWrite(*data++);
+  } while (--len);
+}
 
-void USBNBurstWrite(unsigned char Data)
+void USBNWriteFifoP(unsigned char Adr, const unsigned char* data, unsigned char len)
 {
-   USB_DATA_OUT = Data;       // put data on the bus
-   asm("nop");              // pause for data to get to bus
-   USB_CTRL_PORT ^= (PF_CS | PF_WR);
-   asm("nop");              // pause for data to get to bus
-   USB_CTRL_PORT ^= (PF_CS | PF_WR);
+  if (len == 0)
+    return;
+  USBNAddress(Adr);
+  do
+  {
+    USBNBurstWrite(pgm_read_byte(data++));
+  } while (--len);
 }
 
 
@@ -19,12 +19,19 @@
 #define _MCIFACE_H_
 
 
+#include <avr/io.h>
 #include "usbn2mc/tiny/usbnapi.h"
 
 unsigned char USBNRead(unsigned char Adr);
-unsigned char USBNBurstRead(void);
 void USBNWrite(unsigned char Adr,unsigned char Data);
-void USBNBurstWrite(unsigned char Data);
+
+/* Transfer len bytes from/to the FIFO data register Adr. The address is
+   only written once, then the bytes are streamed by burst strobes.
+   USBNWriteFifoP reads data from flash (PROGMEM).
+*/
+void USBNReadFifo(unsigned char Adr, unsigned char* data, unsigned char len);
+void USBNWriteFifo(unsigned char Adr, const unsigned char* data, unsigned char len);
+void USBNWriteFifoP(unsigned char Adr, const unsigned char* data, unsigned char len);
 
 void USBNInitMC(void);
 
@@ -66,4 +73,25 @@ void USBNInterfaceRequests(DeviceRequest *req,EPInfo* ep);
 
 //#define  PF_RESET    0x10
 
+// Read the next byte from the register selected by the last USBNRead
+static inline unsigned char USBNBurstRead(void)
+{
+  USB_CTRL_PORT ^= (PF_CS | PF_RD);
+  asm volatile("nop");     // pause for data to get to bus
+  asm volatile("nop");
+  USB_CTRL_PORT ^= (PF_CS | PF_RD);
+  asm volatile("nop");     // pause for data to get to bus
+  return USB_DATA_IN;
+}
+
+// Write the next byte to the register selected by the last USBNWrite
+static inline void USBNBurstWrite(unsigned char Data)
+{
+  USB_DATA_OUT = Data;       // put data on the bus
+  asm volatile("nop");     // pause for data to get to bus
+  USB_CTRL_PORT ^= (PF_CS | PF_WR);
+  asm volatile("nop");     // pause for data to get to bus
+  USB_CTRL_PORT ^= (PF_CS | PF_WR);
+}
+
 #endif /* _MCIFACE_H_ */
@@ -37,10 +37,28 @@
 EPInfo	EP0rx;
 EPInfo	EP0tx;
 
+/* Stages of a control transfer on EP0:
+   EP0_IDLE: waiting for a setup packet
+   EP0_DATA_IN: EP0tx.Buf is sent, the host ends this by the status OUT packet
+   EP0_DATA_OUT: receiving into EP0rx.Buf, see _USBNReceiveData
+   EP0_STATUS_IN: the zero length packet of the status stage is sent
+*/
+#define EP0_IDLE 0
+#define EP0_DATA_IN 1
+#define EP0_DATA_OUT 2
+#define EP0_STATUS_IN 3
+
+unsigned char EP0Stage;
+
 FunctionInfo  USBNFunctionInfo;
 
 uint32_t g_ResetEvents;
 
+volatile unsigned char g_Suspended;    // set by the 3ms suspend event, cleared by resume or reset
+volatile unsigned char g_RemoteWakeup; // DEVICE_REMOTE_WAKEUP enabled by the host
+
+unsigned char EP0StatusBuf[2];        // answer of GET_STATUS
+
 void _USBNInitEP0(void)
 {
   EP0rx.usbnCommand   = RXC0;
@@ -82,27 +100,32 @@ void _USBNNackEvent(void)
 }
 
 
+// data of the last packet of RX FIFO1, given to RX1Callback
+static unsigned char RX1Buf[RX1BUFSIZE];
+
 void _USBNReceiveEvent(void)
 {
   unsigned char event;
   void (*ptr)(char *, int);
-  char buf[64];
   event = USBNRead(RXEV);
-  int i=0;
 
   if(event & RX_FIFO0) _USBNReceiveFIFO0();
   // dynamic function call
   else if(event & RX_FIFO1)
   {
     unsigned char rxs1 = USBNRead(RXS1);
-    int len = rxs1 & 15;
-
-    buf[i] = USBNRead(RXD1);
-    for(i = 1; i < 64; i++)
-      buf[i] = USBNBurstRead();
-
-    ptr = RX1Callback;
-    (*ptr)(buf, len);
+    // the packet is complete, RCOUNT saturates at 15. EP2 packets are at
+    // most RX1BUFSIZE (<= 15) bytes, a longer one is cut off by the flush
+    unsigned char len = rxs1 & 15;
+    if (len > RX1BUFSIZE)
+      len = RX1BUFSIZE;
+    USBNReadFifo(RXD1, RX1Buf, len);
+
+    if (!(rxs1 & RX_ERR))
+    {
+      ptr = RX1Callback;
+      (*ptr)((char *)RX1Buf, len);
+    }
 
     USBNWrite(RXC1,FLUSH);
     USBNWrite(RXC1,RX_EN);
@@ -115,6 +138,7 @@ void _USBNReceiveEvent(void)
 void _USBNTransmitEvent(void)
 {
   unsigned char event;
+  void (*ptr)(uint8_t);
   event = USBNRead(TXEV);
   //USBNDebug("tx event\r\n");
   if(event & TX_FIFO0) _USBNTransmitFIFO0();
@@ -122,9 +146,14 @@ void _USBNTransmitEvent(void)
     #if DEBUG
       USBNDebug("tx event\r\n");
     #endif
-    USBNRead(TXS1);                        // get transmitter status
+    unsigned char txs1 = USBNRead(TXS1);   // get transmitter status
     USBNRead(TXS2);                        // get transmitter status
     USBNRead(TXS3);                        // get transmitter status
+    if ((event & TX_FIFO1) && (TX1Callback))
+    {
+      ptr = TX1Callback;
+      (*ptr)(txs1);
+    }
   }
 }
 
@@ -145,11 +174,14 @@ void _USBNAlternateEvent(void)
     USBNWrite(NFSR,OPR_ST);                   // NFS = NodeOperational
     //USBNDebug("reset\r\n");
     g_ResetEvents++;
+    g_Suspended = 0;
+    g_RemoteWakeup = 0;                       // a reset disables the remote wakeup
   }
   if(event & ALT_SD3)
   {
     USBNWrite(ALTMSK,ALT_RESUME+ALT_RESET);   // adjust interrupts
     USBNWrite(NFSR,SUS_ST);                   // enter suspend state
+    g_Suspended = 1;
     USBNDebug("sd3\r\n");
 
   }
@@ -160,6 +192,7 @@ void _USBNAlternateEvent(void)
     USBNWrite(RXC0,RX_EN);                    // allow reception
     USBNWrite(TXC0,FLUSH);
     USBNWrite(NFSR,OPR_ST);
+    g_Suspended = 0;
     USBNDebug("resume\r\n");
   }
   if(event & ALT_EOP)
@@ -220,9 +253,12 @@ void _USBNReceiveFIFO0(void)
 
 	if(rxstatus & SETUP_R)
 	{
-		for(i=0;i<8;i++){
-			Buf[i] = USBNRead(EP0rx.usbnData);
-		}
+		EP0Stage = EP0_IDLE;      // a new setup aborts a pending transfer
+		EP0rx.Size = 0;
+		EP0tx.Size = 0;           // set by the decoders if there is a data IN stage
+		EP0tx.Index = 0;
+		EP0tx.Zlp = 0;
+		USBNReadFifo(EP0rx.usbnData, (unsigned char *)Buf, 8);
 
 		//#if DEBUG
 		for(i=0;i<8;i++)
@@ -245,12 +281,6 @@ void _USBNReceiveFIFO0(void)
 					switch (req->bRequest)	      // decode request code
 					{
 						#if 0
-						case CLR_FEATURE:
-							#if DEBUG
-							USBNDebug("CLR FEATURE\n\r");
-							#endif
-							//_USBNClearFeature(req);
-						break;
 						case GET_CONFIGURATION:
 							#if DEBUG
 							//USBNDebug("GET CONFIG\n\r");
@@ -268,12 +298,16 @@ void _USBNReceiveFIFO0(void)
 							USBNDebug("GET INTERFACE\n\r");
 							#endif
 						break;
-						case GET_STATUS:
-							#if DEBUG
-							USBNDebug("GET STATUS\n\r");
 							#endif
+						case GET_STATUS:
+							//bit 0: self powered (no), bit 1: remote wakeup enabled
+							EP0StatusBuf[0] = g_RemoteWakeup ? 0x02 : 0x00;
+							EP0StatusBuf[1] = 0;
+							EP0tx.Buf = EP0StatusBuf;
+							EP0tx.Flash = 0;
+							EP0tx.DataPid = 1;
+							EP0tx.Size = 2;
 						break;
-							#endif
 						case SET_ADDRESS:
 							USBNDebug("SET ADDRESS\n\r");
 							USBNWrite(EPC0,DEF);
@@ -284,9 +318,18 @@ void _USBNReceiveFIFO0(void)
 							_USBNSetConfiguration(req);
 						break;
 						case SET_FEATURE:
-							//done by the BIOS, sets something about remote wakeup. We ignore this
-							USBNDebug("SET FEATURE\n\r");
-							_USBNTransmitEmtpy(&EP0tx);
+						case CLR_FEATURE:
+							//DEVICE_REMOTE_WAKEUP is the only feature of a full speed device
+							USBNDebug("SET/CLR FEATURE\n\r");
+							if (req->wValue == DEVICE_REMOTE_WAKEUP)
+							{
+								g_RemoteWakeup = (req->bRequest == SET_FEATURE);
+								_USBNTransmitEmtpy(&EP0tx);
+							}
+							else
+							{
+								USBNWrite(EPC0,USBNRead(EPC0)+STALL);      // stall the endpoint
+							}
 						break;
 						case SET_INTERFACE:
 							#if DEBUG
@@ -308,19 +351,16 @@ void _USBNReceiveFIFO0(void)
 				{
 					// default request but for interface not for device
 					USBNInterfaceRequests(req,&EP0tx);
-					_USBNTransmit(&EP0tx);
 				}
 			break;
 			//#if 0
 			case DO_CLASS:				// class request
 				USBNDebug("Class request\n\r");
 				USBNDecodeClassRequest(req,&EP0tx);
-				_USBNTransmit(&EP0tx);
 			break;
 			case DO_VENDOR:				// vendor request
 				USBNDebug("Vendor request\n\r");
 				USBNDecodeVendorRequest(req);
-				_USBNTransmit(&EP0tx);
 			break;
 			default:					// unsupported req type
 				USBNDebug("unsupported req type\r\n");
@@ -328,6 +368,14 @@ void _USBNReceiveFIFO0(void)
 			break;
 		}
 		//#endif
+		if ((EP0tx.Size > 0) && (req->bmRequestType & 0x80))
+		{
+			_USBNTransmitData(req->wLength); // data IN stage
+		}
+		else if (EP0rx.Size > 0)
+		{
+			EP0Stage = EP0_DATA_OUT;
+		}
 		//the following is done for all setup packets.  Note that if
 		//no data was stuffed into the FIFO, the result of the fol-
 		//lowing will be a zero-length response.
@@ -338,24 +386,37 @@ void _USBNReceiveFIFO0(void)
 			USBNWrite(TXC0,TX_TOGL+TX_EN);  //enable the TX (DATA1)
 		}
 	}
-	else                              // if not a setuppacket
+	else if (EP0Stage == EP0_DATA_OUT)  // data stage of a control write
 	{
-		//USBNDebug("error transmit\r\n");
-		if (EP0tx.Size > EP0tx.usbnfifo)   // multi-pkt status stage?
+		unsigned char len = rxstatus & 15;
+		uint16_t left = EP0rx.Size - EP0rx.Index;
+		unsigned char num = (left < len) ? left : len;
+		unsigned char* p = EP0rx.Buf + EP0rx.Index;
+		EP0rx.Index += num;
+		USBNReadFifo(RXD0, p, num);
+		USBNWrite(RXC0,FLUSH);
+		if ((EP0rx.Index >= EP0rx.Size) || (len < EP0rx.usbnfifo)) // last packet
+		{
+			EP0rx.Size = 0;
+			USBNControlDataHook(EP0rx.Buf, EP0rx.Index);
+			EP0Stage = EP0_STATUS_IN;
+			_USBNTransmitEmtpy(&EP0tx);  // status stage
+		}
+		else
 		{
-			#if 0
-			if ((rxstatus& 0x5F)!=0x10)   // length error??
-			{
-				#if DEBUG
-				USBNDebug("length error\r\n");
-				#endif
-			}
-			#endif
-			EP0tx.Size=0;                // exit multi-packet mode
-			USBNWrite(TXC0,FLUSH);       // flush TX0 and disable
-			USBNWrite(RXC0,RX_EN);          // re-enable the receiver
+			USBNWrite(RXC0,RX_EN);       // next packet
 		}
 	}
+	else                              // if not a setuppacket
+	{
+		// status OUT of a data IN stage, the host may send it before all data
+		// has been fetched (e.g. only 8 bytes of the device descriptor)
+		EP0Stage = EP0_IDLE;
+		EP0tx.Size = 0;
+		EP0tx.Zlp = 0;
+		USBNWrite(TXC0,FLUSH);       // flush TX0 and disable
+		USBNWrite(RXC0,RX_EN);          // re-enable the receiver
+	}
 }
 
 
@@ -376,12 +437,22 @@ void _USBNTransmitFIFO0(void)
 
     if(txstat & ACK_STAT)                         // ACK received
     {
-      if(EP0tx.Index < EP0tx.Size)
+      if((EP0Stage == EP0_DATA_IN) && (EP0tx.Index < EP0tx.Size))
       {
         _USBNTransmit(&EP0tx);
       }
+      else if((EP0Stage == EP0_DATA_IN) && (EP0tx.Zlp))
+      {
+        // the data ended with a full packet, but is shorter than requested
+        EP0tx.Zlp = 0;
+        _USBNTransmitWithToggle(&EP0tx);
+      }
       else                                        // not in multi-packet mode
       {
+        if (EP0Stage == EP0_STATUS_IN)
+        {
+          EP0Stage = EP0_IDLE;
+        }
 	USBNWrite(RXC0,RX_EN);               // re-enable the receiver
       }
     }
@@ -435,6 +506,19 @@ void _USBNTransmitWithToggle(EPInfo* ep)
   }
 }
 
+/* Called by the request decoders for a control write with a data stage.
+   The data is received into buf, then USBNControlDataHook is called and the
+   status stage is sent.
+*/
+void _USBNReceiveData(unsigned char* buf, uint16_t size)
+{
+  EP0tx.Size = 0;                 // nothing to send before the status stage
+  EP0rx.Buf = buf;
+  EP0rx.Index = 0;
+  EP0rx.Size = size;
+  USBNWrite(RXC0,RX_EN);
+}
+
 void _USBNTransmitEmtpy(EPInfo* ep)
 {
   USBNWrite(TXC0,FLUSH);       //send data to the FIFO
@@ -444,21 +528,49 @@ void _USBNTransmitEmtpy(EPInfo* ep)
 }
 
 
+/* Starts the data IN stage of a control read with EP0tx.Buf and EP0tx.Size
+   set by the request decoders. The data is limited to wLength. A zero length
+   packet ends the stage if the data is shorter than requested and fills the
+   last packet.
+*/
+void _USBNTransmitData(uint16_t wLength)
+{
+  if (EP0tx.Size > wLength)
+  {
+    EP0tx.Size = wLength;
+  }
+  EP0tx.Index = 0;
+  EP0tx.Zlp = (EP0tx.Size < wLength) && ((EP0tx.Size & (EP0tx.usbnfifo - 1)) == 0);
+  EP0Stage = EP0_DATA_IN;
+  if (EP0tx.Size == 0)
+  {
+    EP0tx.Zlp = 0;
+    EP0Stage = EP0_STATUS_IN;
+    _USBNTransmitEmtpy(&EP0tx);
+  }
+  else
+  {
+    _USBNTransmit(&EP0tx);
+  }
+}
+
 void _USBNTransmit(EPInfo* ep)
 {
-  int i;
   if(ep->Size > 0)
   {
     if(ep->Index < ep->Size)
     {
+      uint16_t left = ep->Size - ep->Index;
+      unsigned char num = (left < ep->usbnfifo) ? left : ep->usbnfifo;
+      const unsigned char* p = ep->Buf + ep->Index;
+      ep->Index += num;
       USBNWrite(TXC0,FLUSH);       //send data to the FIFO
       while (USBNRead(TXC0) & FLUSH); //Malte: otherwise the usbn960x sometimes sends invalid packages
       //USBNDebug(" ");
-      for(i=0;((i < 8) & (ep->Index < ep->Size)); i++)
-      {
-        USBNWrite(TXD0,ep->Buf[ep->Index]);
-        ep->Index++;
-      }
+      if (ep->Flash)
+        USBNWriteFifoP(TXD0, p, num);
+      else
+        USBNWriteFifo(TXD0, p, num);
 
       // if end of multipaket
       if(ep->Size<=ep->Index)
@@ -530,20 +642,22 @@ void _USBNGetDescriptor(DeviceRequest *req)
 
   EP0tx.Index = 0;
   EP0tx.DataPid = 1;
+  EP0tx.Flash = 1;                    // all descriptors are in flash
   switch (type)
   {
     case DEVICE:
       USBNDebug("DEVICE DESCRIPTOR\n\r");
-      EP0tx.Size = DeviceDescriptor[0];
-      EP0tx.Buf = DeviceDescriptor;
+      EP0tx.Size = pgm_read_byte(&DeviceDescriptor[0]);
+      EP0tx.Buf = (unsigned char *)DeviceDescriptor;
 
       // first get descriptor request is
       // always be answered with first 8 unsigned chars of dev descriptor
       // Linux and Windows therefore request 64 bytes at the first call
       // The BIOS however (at least the Asus Eee netbook I tested)
       // reqeusts just 8. So comparing to 64 is insufficient.
+      // As the 8 bytes are a full packet, a zero length packet follows.
       //printf_P(PSTR("L:%u\n\r"), req->wLength);
-      if(req->wLength != DeviceDescriptor[0])
+      if(req->wLength != EP0tx.Size)
       {
         EP0tx.Size = 8;
         //USBNDebug("D First\n\r");
@@ -557,33 +671,21 @@ void _USBNGetDescriptor(DeviceRequest *req)
       //The Lenovo T440 BIOS requests 8 and then 41 bytes
       USBNDebug("CONFIGURATION DESCRIPTOR\n\r");
       //printf_P(PSTR("L:%u\n\r"), req->wLength);
-      // send complete tree
-      if (req->wLength > ConfigurationDescriptor[2]) //only works for <= 255 bytes
-      {
-        EP0tx.Size = ConfigurationDescriptor[2]; //9 bytes
-      }
-      else
-      {
-        EP0tx.Size = req->wLength;
-      }
-      EP0tx.Buf = ConfigurationDescriptor;
-
+      // send complete tree, limited to wLength by _USBNTransmitData
+      EP0tx.Size = pgm_read_word(&ConfigurationDescriptor[2]); //wTotalLength
+      EP0tx.Buf = (unsigned char *)ConfigurationDescriptor;
     break;
     case STRING:
       //changed by Malte Marwedel
       if ((index > 0) && (index <= FINALSTRINGARRAYSUPP) && (FinalStringArray[index -1]))
       {
-         EP0tx.Buf = (unsigned char *)(&FinalStringArray[index -1][0]);
-         EP0tx.Size = FinalStringArray[index -1][0]; //stores the length of itself
-         if (EP0tx.Buf[0] < EP0tx.Size)
-         {
-            EP0tx.Size = EP0tx.Buf[0];
-         }
+         EP0tx.Buf = (unsigned char *)FinalStringArray[index -1];
+         EP0tx.Size = pgm_read_byte(&EP0tx.Buf[0]); //stores the length of itself
       }
       else if (index == 0) {
-        static unsigned char lang[]={0x04,0x03,0x09,0x04}; //0x4=length, 0x3=string descriptor, 0x0409 indicates us english
+        static const unsigned char lang[] PROGMEM = {0x04,0x03,0x09,0x04}; //0x4=length, 0x3=string descriptor, 0x0409 indicates us english
         EP0tx.Size=4;
-        EP0tx.Buf=lang;
+        EP0tx.Buf=(unsigned char *)lang;
       }
       else
       {
@@ -591,12 +693,15 @@ void _USBNGetDescriptor(DeviceRequest *req)
         EP0tx.Buf=NULL;
       }
       break;
-
+    default:
+      EP0tx.Size=0; //e.g. the device qualifier, which only high speed devices have
+    break;
   }
-  //if (EP0rx.Buf[7]==0)                  //if less than 256 req'd
-  //  if (EP0tx.Size > EP0rx.Buf[6]) EP0tx.Size = EP0rx.Buf[6];
-//printf("Desc togl: %u \r\n", EP0tx.DataPid);
-  _USBNTransmit(&EP0tx);
+  if (EP0tx.Size == 0)
+  {
+    USBNWrite(EPC0,USBNRead(EPC0)+STALL);      // stall the endpoint
+  }
+  //the data IN stage is started by _USBNReceiveFIFO0
 }
 
 
@@ -609,6 +714,7 @@ void _USBNSetConfiguration(DeviceRequest *req)
 	USBNWrite(RXC1, FLUSH);
 	USBNWrite(EPC2,EP_EN+0x02); //rx endpoint 2 with address 2
 	USBNWrite(RXC1,RX_EN);
+	USBNSetConfigurationHook();
 	while (USBNRead(TXC0) & FLUSH); //Malte: otherwise the usbn960x sometimes sends invalid packages
 	//the caller will already send the data, because this request has bmRequestType = 0
 }
@@ -620,4 +726,29 @@ uint32_t USBNGetResetEvents(void)
 	num = g_ResetEvents;
 	sei();
 	return num;
+}
+
+unsigned char USBNSuspended(void)
+{
+	return g_Suspended;
+}
+
+unsigned char USBNRemoteWakeup(void)
+{
+	cli();
+	if ((!g_Suspended) || (!g_RemoteWakeup))
+	{
+		sei();
+		return 0;
+	}
+	USBNWrite(ALTMSK,ALT_RESET);              // our own K state is no resume event
+	USBNWrite(NFSR,RSM_ST);                   // drive resume to the host
+	sei();
+	_delay_ms(10);                            // 1..15ms according to the USB specification
+	cli();
+	USBNWrite(NFSR,OPR_ST);
+	USBNWrite(ALTMSK,ALT_SD3+ALT_RESET+ALT_RESUME);
+	g_Suspended = 0;
+	sei();
+	return 1;
 }
\ No newline at end of file
@@ -24,17 +24,27 @@
 #include "../usbn960xreg.h"
 #include "../usb11spec.h"
 
-unsigned char *DeviceDescriptor;
-unsigned char *ConfigurationDescriptor;
+//in flash (PROGMEM)
+const unsigned char *DeviceDescriptor;
+const unsigned char *ConfigurationDescriptor;
 struct string_entry*  StringList;
 
 #define FINALSTRINGARRAYSUPP 16
 
-char* FinalStringArray[FINALSTRINGARRAYSUPP];
+//string descriptors in flash (PROGMEM)
+const void* FinalStringArray[FINALSTRINGARRAYSUPP];
 
 
 
 void *RX1Callback;
+//at least the max packet size of the OUT endpoint of RX FIFO1, RCOUNT limits it to 15
+#ifndef RX1BUFSIZE
+#define RX1BUFSIZE 8
+#endif
+#if RX1BUFSIZE > 15
+#error "RX1BUFSIZE must be <= 15, longer packets are not read from RX FIFO1"
+#endif
+void *TX1Callback;
 
 
 
@@ -83,10 +93,12 @@ struct epinfo {
   unsigned char	  usbnCommand;
   unsigned char	  usbnControl;
   unsigned char	  DataPid; // 0 = data0, 1 = data1
-  int		  usbnfifo;
-  int		  Index;
-  int		  Size;
+  unsigned char	  usbnfifo;
+  uint16_t	  Index;
+  uint16_t	  Size;
   unsigned char*  Buf;
+  unsigned char	  Flash; // 1 = Buf is in flash (PROGMEM), only for transmitting
+  unsigned char	  Zlp; // 1 = a zero length packet follows the data
 };
 
 unsigned char EP0RXBuf[8];
@@ -109,6 +121,8 @@ void _USBNTransmit(EPInfo* ep);
 void _USBNReceive(EPInfo* ep);
 
 void _USBNTransmitEmtpy(EPInfo* ep);
+void _USBNReceiveData(unsigned char* buf, uint16_t size);
+void _USBNTransmitData(uint16_t wLength);
 void _USBNTransmitWithToggle(EPInfo* ep);
 
 void _USBNTransmitFIFO0(void);
@@ -126,8 +140,22 @@ void USBNDebug(char *msg);
 //only for compiler
 void USBNDecodeVendorRequest(DeviceRequest *req);
 void USBNDecodeClassRequest(DeviceRequest *req,EPInfo* ep);
+//called after the host selected the configuration, the FIFOs of EP1 and EP2 are flushed
+void USBNSetConfigurationHook(void);
+//called after the data stage requested by _USBNReceiveData, before the status stage
+void USBNControlDataHook(unsigned char* buf, int len);
 
 uint32_t USBNGetResetEvents(void);
 
+//1 if the bus is suspended (3ms without traffic)
+unsigned char USBNSuspended(void);
+
+/*by Malte Marwedel
+Device initiated resume, if the bus is suspended and the host enabled the
+remote wakeup. Blocks for 10ms, call from the main loop, not within the
+interrupt. Returns 1 if the resume has been signalled.
+*/
+unsigned char USBNRemoteWakeup(void);
+
 
 #endif /* __USBN960X_H__ */
@@ -23,7 +23,7 @@
 
 
 // setup global datastructure
-void USBNInit(unsigned char* _DeviceDescriptor,unsigned char* _ConfigurationDescriptor)
+void USBNInit(const unsigned char* _DeviceDescriptor,const unsigned char* _ConfigurationDescriptor)
 {
   DeviceDescriptor=_DeviceDescriptor;
   ConfigurationDescriptor=_ConfigurationDescriptor;
@@ -35,6 +35,11 @@ void USBNCallbackFIFORX1(void *fct)
   RX1Callback = fct;
 }
 
+void USBNCallbackFIFOTX1(void *fct)
+{
+  TX1Callback = fct;
+}
+
 
 void USBNStart(void)
 {
@@ -210,23 +215,11 @@ uint8_t USBNAddToStringList( void* data)
 /*by Malte Marwedel.
 We shift the index by one, so if usb descriptor requests index 1, its in the array at 0.
 */
-void USBNSetString(char * permanentBuffer, size_t len, const char * inputString, uint8_t index)
+void USBNSetString(const void * descriptor, uint8_t index)
 {
 	if ((index > 0) && (index <= FINALSTRINGARRAYSUPP))
 	{
-		size_t lenInput = strlen(inputString);
-		size_t required = lenInput*2 + 2;
-		if ((required <= len) && (required <= 255))
-		{
-			permanentBuffer[0] = required;
-			permanentBuffer[1] = 0x3; //string descriptor
-			for (uint8_t i = 0; i < lenInput; i++) //from 8 bit ascii to 16bit unicode
-			{
-				permanentBuffer[i*2+2] = inputString[i];
-				permanentBuffer[i*2+3] = 0;
-			}
-			FinalStringArray[index -1] = permanentBuffer;
-		}
+		FinalStringArray[index -1] = descriptor;
 	}
 }
 
@@ -25,10 +25,17 @@
 #include "../usbn960xreg.h"
 
 /// initial global data structures
-void USBNInit(unsigned char *_DeviceDescriptor,unsigned char *_ConfigurationDescriptor);
+/// both descriptors must be in flash (PROGMEM)
+void USBNInit(const unsigned char *_DeviceDescriptor,const unsigned char *_ConfigurationDescriptor);
 
 void USBNCallbackFIFORX1(void *fct);
 
+/*by Malte Marwedel
+fct: void fct(uint8_t txs1), called within the interrupt when a packet of
+TX FIFO1 has been sent, txs1 is the value of the TX status register 1.
+*/
+void USBNCallbackFIFOTX1(void *fct);
+
 /// start usb system after configuration
 void USBNStart(void);
 
@@ -49,14 +56,11 @@ int _USBNAddStringDescriptor(char *string);
 #else
 
 /*by Malte Marwedel
-permanentBuffer: must be a buffer which stays available even after the function is done.
-Either allocated by malloc, a global variable, static local variable, or stack
-variable declared directly in main().
-len: The lenght of this buffer. To succeed, it should be strlen(inputString)* 2 + 2 in bytes
-inputString: String to copy, can be discharged after calling this function
+descriptor: complete string descriptor in flash (PROGMEM): length, 0x03, then
+the string in UTF-16.
 index: Index the host will be used to request this string, used in the USB descriptor
 */
-void USBNSetString(char * permanentBuffer, size_t len, const char * inputString, uint8_t index);
+void USBNSetString(const void * descriptor, uint8_t index);
 
 #endif
 
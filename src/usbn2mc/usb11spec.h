@@ -128,6 +128,13 @@ struct usb_string_descriptor {
 #define GET_INTERFACE	  		0x0A
 #define SET_INTERFACE	  		0x0B
 
+/*-------------------------------------------
+ * feature selectors 
+ * ------------------------------------------*/
+
+#define ENDPOINT_HALT			0x00
+#define DEVICE_REMOTE_WAKEUP	0x01
+
 
 /*-------------------------------------------
  * descriptor types 